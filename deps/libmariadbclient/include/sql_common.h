@@ -44,6 +44,8 @@ struct st_mysql_options_extention {
   struct mysql_async_context *async_context;
   HASH connection_attributes;
   size_t connection_attributes_length;
+  /* Use a private SSL context and never resume sessions */
+  my_bool no_ssl_session_cache;
 };
 
 typedef struct st_mysql_methods
@@ -154,13 +154,18 @@ enum enum_ssl_init_error
 };
 const char* sslGetErrString(enum enum_ssl_init_error err);
 
+struct st_VioSSLSessionCache;
+
 struct st_VioSSLFd
 {
   SSL_CTX *ssl_context;
+  /* Non-NULL for connectors shared via acquire_VioSSLConnectorFd() */
+  struct st_VioSSLSessionCache *session_cache;
 };
 
 int sslaccept(struct st_VioSSLFd*, Vio *, long timeout, unsigned long *errptr);
-int sslconnect(struct st_VioSSLFd*, Vio *, long timeout, unsigned long *errptr);
+int sslconnect(struct st_VioSSLFd*, Vio *, long timeout, const char *peer,
+               unsigned long *errptr);
 
 struct st_VioSSLFd
 *new_VioSSLConnectorFd(const char *key_file, const char *cert_file,
@@ -173,6 +178,16 @@ struct st_VioSSLFd
 		      const char *cipher, enum enum_ssl_init_error *error,
                       const char *crl_file, const char *crl_path);
 void free_vio_ssl_acceptor_fd(struct st_VioSSLFd *fd);
+struct st_VioSSLFd
+*acquire_VioSSLConnectorFd(const char *key_file, const char *cert_file,
+                           const char *ca_file,  const char *ca_path,
+                           const char *cipher, enum enum_ssl_init_error *error,
+                           const char *crl_file, const char *crl_path);
+void release_VioSSLConnectorFd(struct st_VioSSLFd *fd);
+void free_vio_ssl_connector_cache(void);
+my_bool vio_ssl_resume_session(struct st_VioSSLFd *fd, const char *peer,
+                               SSL *ssl);
+void vio_ssl_save_session(struct st_VioSSLFd *fd, const char *peer, SSL *ssl);
 #endif /* HAVE_OPENSSL */
 
 void vio_end(void);
@@ -1878,8 +1878,7 @@ mysql_ssl_free(MYSQL *mysql __attribute__((unused)))
     my_free(mysql->options.extension->ssl_crlpath);
   }
   if (ssl_fd)
-    SSL_CTX_free(ssl_fd->ssl_context);
-  my_free(mysql->connector_fd);
+    release_VioSSLConnectorFd(ssl_fd);
   mysql->options.ssl_key = 0;
   mysql->options.ssl_cert = 0;
   mysql->options.ssl_ca = 0;
@@ -2710,6 +2709,7 @@ static int send_client_reply_packet(MCPVIO_EXT *mpvio,
     enum enum_ssl_init_error ssl_init_error;
     const char *cert_error;
     unsigned long ssl_error;
+    char peer[FN_REFLEN];
 
     /*
       Send mysql->client_flag, max_packet_size - unencrypted otherwise
@@ -2724,8 +2724,25 @@ static int send_client_reply_packet(MCPVIO_EXT *mpvio,
       goto error;
     }
 
-    /* Create the VioSSLConnectorFd - init SSL and load certs */
-    if (!(ssl_fd= new_VioSSLConnectorFd(options->ssl_key,
+    /*
+      Create the VioSSLConnectorFd - init SSL and load certs. Unless disabled,
+      the connector is shared with other connections using the same options
+      and remembers sessions so reconnects can resume them.
+    */
+    if (options->extension && options->extension->no_ssl_session_cache)
+    {
+      ssl_fd= new_VioSSLConnectorFd(options->ssl_key,
+                                    options->ssl_cert,
+                                    options->ssl_ca,
+                                    options->ssl_capath,
+                                    options->ssl_cipher,
+                                    &ssl_init_error,
+                                    options->extension->ssl_crl,
+                                    options->extension->ssl_crlpath);
+    }
+    else
+    {
+      ssl_fd= acquire_VioSSLConnectorFd(options->ssl_key,
                                         options->ssl_cert,
                                         options->ssl_ca,
                                         options->ssl_capath,
@@ -2734,7 +2751,9 @@ static int send_client_reply_packet(MCPVIO_EXT *mpvio,
                                         options->extension ? 
                                         options->extension->ssl_crl : NULL,
                                         options->extension ? 
-                                        options->extension->ssl_crlpath : NULL)))
+                                        options->extension->ssl_crlpath : NULL);
+    }
+    if (!ssl_fd)
     {
       set_mysql_extended_error(mysql, CR_SSL_CONNECTION_ERROR, unknown_sqlstate,
                                ER(CR_SSL_CONNECTION_ERROR), sslGetErrString(ssl_init_error));
@@ -2744,8 +2763,12 @@ static int send_client_reply_packet(MCPVIO_EXT *mpvio,
 
     /* Connect to the server */
     DBUG_PRINT("info", ("IO layer change in progress..."));
+    if (mysql->unix_socket)
+      my_snprintf(peer, sizeof(peer), "%s", mysql->unix_socket);
+    else
+      my_snprintf(peer, sizeof(peer), "%s:%u", mysql->host, mysql->port);
     if (sslconnect(ssl_fd, net->vio,
-                   (long) (mysql->options.connect_timeout), &ssl_error))
+                   (long) (mysql->options.connect_timeout), peer, &ssl_error))
     {    
       char buf[512];
       ERR_error_string_n(ssl_error, buf, 512);
@@ -4472,6 +4495,10 @@ mysql_options(MYSQL *mysql,enum mysql_option option, const void *arg)
   case MYSQL_OPT_USE_THREAD_SPECIFIC_MEMORY:
     mysql->options.use_thread_specific_memory= *(my_bool *) arg;
     break;
+  case MYSQL_OPT_SSL_SESSION_CACHE:
+    ENSURE_EXTENSIONS_PRESENT(&mysql->options);
+    mysql->options.extension->no_ssl_session_cache= !*(my_bool*) arg;
+    break;
   case MYSQL_OPT_SSL_VERIFY_SERVER_CERT:
     if (*(my_bool*) arg)
       mysql->options.client_flag|= CLIENT_SSL_VERIFY_SERVER_CERT;
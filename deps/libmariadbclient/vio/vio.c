@@ -385,6 +385,9 @@ void vio_delete(Vio* vio)
 */
 void vio_end(void)
 {
+#ifdef HAVE_OPENSSL
+  free_vio_ssl_connector_cache();
+#endif
 #ifdef HAVE_YASSL
   yaSSL_CleanUp();
 #elif defined(HAVE_OPENSSL)
@@ -311,7 +311,8 @@ static int ssl_handshake_loop(Vio *vio, SSL *ssl, ssl_handshake_func_t func)
 
 
 static int ssl_do(struct st_VioSSLFd *ptr, Vio *vio, long timeout,
-                  ssl_handshake_func_t func, unsigned long *errptr)
+                  ssl_handshake_func_t func, const char *peer,
+                  unsigned long *errptr)
 {
   int r;
   SSL *ssl;
@@ -337,6 +338,10 @@ static int ssl_do(struct st_VioSSLFd *ptr, Vio *vio, long timeout,
   SSL_SESSION_set_timeout(SSL_get_session(ssl), timeout);
   SSL_set_fd(ssl, sd);
 
+  /* Offer a previously negotiated session to skip the full handshake */
+  if (vio_ssl_resume_session(ptr, peer, ssl))
+    DBUG_PRINT("info", ("offering cached session for %s", peer));
+
   /*
     Since yaSSL does not support non-blocking send operations, use
     special transport functions that properly handles non-blocking
@@ -364,6 +369,8 @@ static int ssl_do(struct st_VioSSLFd *ptr, Vio *vio, long timeout,
     DBUG_RETURN(1);
   }
 
+  vio_ssl_save_session(ptr, peer, ssl);
+
   /*
     Connection succeeded. Install new function handlers,
     change type, set sd to the fd used when connecting
@@ -412,14 +419,15 @@ static int ssl_do(struct st_VioSSLFd *ptr, Vio *vio, long timeout,
 int sslaccept(struct st_VioSSLFd *ptr, Vio *vio, long timeout, unsigned long *errptr)
 {
   DBUG_ENTER("sslaccept");
-  DBUG_RETURN(ssl_do(ptr, vio, timeout, SSL_accept, errptr));
+  DBUG_RETURN(ssl_do(ptr, vio, timeout, SSL_accept, NULL, errptr));
 }
 
 
-int sslconnect(struct st_VioSSLFd *ptr, Vio *vio, long timeout, unsigned long *errptr)
+int sslconnect(struct st_VioSSLFd *ptr, Vio *vio, long timeout,
+               const char *peer, unsigned long *errptr)
 {
   DBUG_ENTER("sslconnect");
-  DBUG_RETURN(ssl_do(ptr, vio, timeout, SSL_connect, errptr));
+  DBUG_RETURN(ssl_do(ptr, vio, timeout, SSL_connect, peer, errptr));
 }
 
 
@@ -15,6 +15,7 @@
    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA */
 
 #include "vio_priv.h"
+#include <my_dir.h>
 
 #ifdef HAVE_OPENSSL
 
@@ -184,6 +185,7 @@ new_VioSSLFd(const char *key_file, const char *cert_file,
   if (!(ssl_fd= ((struct st_VioSSLFd*)
                  my_malloc(sizeof(struct st_VioSSLFd),MYF(0)))))
     goto err0;
+  ssl_fd->session_cache= NULL;
   if (!(ssl_fd->ssl_context= SSL_CTX_new(is_client_method ? 
                                          SSLv23_client_method() :
                                          SSLv23_server_method())))
@@ -354,4 +356,364 @@ void free_vio_ssl_acceptor_fd(struct st_VioSSLFd *fd)
   SSL_CTX_free(fd->ssl_context);
   my_free(fd);
 }
+
+
+/************************ Shared VioSSLConnectorFd ***************************/
+/*
+  Building a connector context means parsing certificates, keys and CA files,
+  which is far more expensive than the connection it is used for. Connectors
+  are therefore shared by every connection using the same SSL configuration
+  and kept around (up to SSL_CONNECTOR_CACHE_SIZE idle ones) after the last
+  connection using them is closed.
+
+  Each shared connector also remembers the last session established with
+  every peer ("host:port" or the socket path), so a reconnect can offer it to
+  the server and resume it with an abbreviated handshake instead of a full
+  key exchange.
+
+  Connectors are looked up by their options, but the files behind them may be
+  replaced while the process runs (e.g. when certificates or CRLs are
+  rotated). The inode, size and modification time of every file and directory
+  option are therefore stored with the connector, and a connector whose files
+  have changed is dropped instead of reused.
+
+  Sessions are only offered for SSL_SESSION_LIFETIME seconds after they were
+  created. This is below both OpenSSL's default session timeout and yaSSL's
+  DEFAULT_TIMEOUT; the latter matters because yaSSL hands out pointers into
+  its global session cache, which frees entries once they expire.
+
+  The cache is protected by THR_LOCK_net, which mysys initializes in my_init()
+  but the client library does not otherwise use.
+*/
+
+#define SSL_CONNECTOR_CACHE_SIZE 16
+#define SSL_SESSION_SLOTS        16
+#define SSL_SESSION_LIFETIME     300
+
+#define SSL_CONNECTOR_OPTIONS    7
+
+extern mysql_mutex_t THR_LOCK_net;
+
+struct st_VioSSLSession
+{
+  char *peer;
+  SSL_SESSION *session;
+  time_t created;
+};
+
+struct st_VioSSLFileStamp
+{
+  ino_t inode;
+  my_off_t size;
+  time_t mtime;
+};
+
+struct st_VioSSLSessionCache
+{
+  struct st_VioSSLFd *fd;
+  struct st_VioSSLSessionCache *next;
+  char *options[SSL_CONNECTOR_OPTIONS];
+  struct st_VioSSLFileStamp stamps[SSL_CONNECTOR_OPTIONS];
+  uint refs;
+  uint next_slot;
+  struct st_VioSSLSession sessions[SSL_SESSION_SLOTS];
+};
+
+static struct st_VioSSLSessionCache *ssl_connectors= NULL;
+
+
+static my_bool same_option(const char *a, const char *b)
+{
+  if (!a || !b)
+    return a == b;
+  return strcmp(a, b) == 0;
+}
+
+
+/* Missing files (and the cipher list, which is not a file) get a zero stamp. */
+static void stamp_options(const char **options,
+                          struct st_VioSSLFileStamp *stamps)
+{
+  MY_STAT stat_info;
+  uint i;
+  for (i= 0; i < SSL_CONNECTOR_OPTIONS; i++)
+  {
+    bzero(&stamps[i], sizeof(stamps[i]));
+    if (i != 4 /* cipher */ && options[i] &&
+        my_stat(options[i], &stat_info, MYF(0)))
+    {
+      stamps[i].inode= stat_info.st_ino;
+      stamps[i].size= (my_off_t) stat_info.st_size;
+      stamps[i].mtime= stat_info.st_mtime;
+    }
+  }
+}
+
+
+static my_bool same_stamps(const struct st_VioSSLFileStamp *a,
+                           const struct st_VioSSLFileStamp *b)
+{
+  uint i;
+  for (i= 0; i < SSL_CONNECTOR_OPTIONS; i++)
+    if (a[i].inode != b[i].inode || a[i].size != b[i].size ||
+        a[i].mtime != b[i].mtime)
+      return FALSE;
+  return TRUE;
+}
+
+
+static void clear_session(struct st_VioSSLSession *s)
+{
+  if (s->session)
+    SSL_SESSION_free(s->session);
+  my_free(s->peer);
+  s->peer= NULL;
+  s->session= NULL;
+}
+
+
+/* Free the cache entry, and the connector too unless it is still in use. */
+static void free_session_cache(struct st_VioSSLSessionCache *cache)
+{
+  struct st_VioSSLFd *fd= cache->fd;
+  my_bool in_use= cache->refs != 0;
+  uint i;
+  for (i= 0; i < SSL_SESSION_SLOTS; i++)
+    clear_session(&cache->sessions[i]);
+  for (i= 0; i < SSL_CONNECTOR_OPTIONS; i++)
+    my_free(cache->options[i]);
+  my_free(cache);
+  fd->session_cache= NULL;
+  if (!in_use)
+  {
+    SSL_CTX_free(fd->ssl_context);
+    my_free(fd);
+  }
+}
+
+
+/* Drop idle connectors beyond the cache size, oldest first. */
+static void trim_connector_cache(void)
+{
+  struct st_VioSSLSessionCache **prev= &ssl_connectors;
+  uint idle= 0;
+
+  while (*prev)
+  {
+    struct st_VioSSLSessionCache *cache= *prev;
+    if (cache->refs == 0 && ++idle > SSL_CONNECTOR_CACHE_SIZE)
+    {
+      *prev= cache->next;
+      free_session_cache(cache);
+      continue;
+    }
+    prev= &cache->next;
+  }
+}
+
+
+struct st_VioSSLFd *
+acquire_VioSSLConnectorFd(const char *key_file, const char *cert_file,
+                          const char *ca_file, const char *ca_path,
+                          const char *cipher, enum enum_ssl_init_error *error,
+                          const char *crl_file, const char *crl_path)
+{
+  const char *options[SSL_CONNECTOR_OPTIONS];
+  struct st_VioSSLFileStamp stamps[SSL_CONNECTOR_OPTIONS];
+  struct st_VioSSLSessionCache *cache, **prev;
+  struct st_VioSSLFd *ssl_fd;
+  uint i;
+  DBUG_ENTER("acquire_VioSSLConnectorFd");
+
+  options[0]= key_file;
+  options[1]= cert_file;
+  options[2]= ca_file;
+  options[3]= ca_path;
+  options[4]= cipher;
+  options[5]= crl_file;
+  options[6]= crl_path;
+  stamp_options(options, stamps);
+
+  mysql_mutex_lock(&THR_LOCK_net);
+  for (prev= &ssl_connectors; (cache= *prev); prev= &cache->next)
+  {
+    for (i= 0; i < SSL_CONNECTOR_OPTIONS; i++)
+      if (!same_option(cache->options[i], options[i]))
+        break;
+    if (i == SSL_CONNECTOR_OPTIONS)
+    {
+      if (!same_stamps(cache->stamps, stamps))
+      {
+        /*
+          The files were replaced. Connections still using the old connector
+          free it themselves once the cache entry is gone.
+        */
+        DBUG_PRINT("info", ("files changed, dropping connector: 0x%lx",
+                            (long) cache->fd));
+        *prev= cache->next;
+        free_session_cache(cache);
+        break;
+      }
+      /* Move to the front so trimming evicts the least recently used */
+      *prev= cache->next;
+      cache->next= ssl_connectors;
+      ssl_connectors= cache;
+      cache->refs++;
+      mysql_mutex_unlock(&THR_LOCK_net);
+      DBUG_PRINT("info", ("reusing connector: 0x%lx", (long) cache->fd));
+      DBUG_RETURN(cache->fd);
+    }
+  }
+  mysql_mutex_unlock(&THR_LOCK_net);
+
+  /* Load certificates outside of the lock, this is the slow part */
+  if (!(ssl_fd= new_VioSSLConnectorFd(key_file, cert_file, ca_file, ca_path,
+                                      cipher, error, crl_file, crl_path)))
+    DBUG_RETURN(0);
+
+  if (!(cache= (struct st_VioSSLSessionCache*)
+        my_malloc(sizeof(struct st_VioSSLSessionCache),
+                  MYF(MY_WME | MY_ZEROFILL))))
+  {
+    /* Still usable, just not shared */
+    DBUG_RETURN(ssl_fd);
+  }
+  for (i= 0; i < SSL_CONNECTOR_OPTIONS; i++)
+  {
+    if (options[i] && !(cache->options[i]= my_strdup(options[i], MYF(MY_WME))))
+    {
+      while (i)
+        my_free(cache->options[--i]);
+      my_free(cache);
+      DBUG_RETURN(ssl_fd);
+    }
+  }
+  memcpy(cache->stamps, stamps, sizeof(stamps));
+  cache->fd= ssl_fd;
+  cache->refs= 1;
+  ssl_fd->session_cache= cache;
+
+  mysql_mutex_lock(&THR_LOCK_net);
+  cache->next= ssl_connectors;
+  ssl_connectors= cache;
+  mysql_mutex_unlock(&THR_LOCK_net);
+
+  DBUG_RETURN(ssl_fd);
+}
+
+
+/*
+  fd->session_cache is only read under the lock in the functions below, as
+  another thread may drop the cache entry of a connector still in use.
+*/
+void release_VioSSLConnectorFd(struct st_VioSSLFd *fd)
+{
+  my_bool shared;
+
+  mysql_mutex_lock(&THR_LOCK_net);
+  if ((shared= fd->session_cache != NULL) && --fd->session_cache->refs == 0)
+    trim_connector_cache();
+  mysql_mutex_unlock(&THR_LOCK_net);
+
+  if (!shared)
+  {
+    SSL_CTX_free(fd->ssl_context);
+    my_free(fd);
+  }
+}
+
+
+void free_vio_ssl_connector_cache(void)
+{
+  struct st_VioSSLSessionCache *cache, *next;
+
+  mysql_mutex_lock(&THR_LOCK_net);
+  for (cache= ssl_connectors; cache; cache= next)
+  {
+    next= cache->next;
+    /* Connectors still in use are freed by their connections */
+    free_session_cache(cache);
+  }
+  ssl_connectors= NULL;
+  mysql_mutex_unlock(&THR_LOCK_net);
+}
+
+
+my_bool vio_ssl_resume_session(struct st_VioSSLFd *fd, const char *peer,
+                               SSL *ssl)
+{
+  struct st_VioSSLSessionCache *cache;
+  my_bool resumed= FALSE;
+  time_t now;
+  uint i;
+
+  if (!peer)
+    return FALSE;
+
+  now= my_time(0);
+  mysql_mutex_lock(&THR_LOCK_net);
+  cache= fd->session_cache;
+  for (i= 0; cache && i < SSL_SESSION_SLOTS; i++)
+  {
+    struct st_VioSSLSession *s= &cache->sessions[i];
+    if (!s->peer || strcmp(s->peer, peer))
+      continue;
+    if (now - s->created >= SSL_SESSION_LIFETIME)
+      clear_session(s);
+    else
+      resumed= SSL_set_session(ssl, s->session) == 1;
+    break;
+  }
+  mysql_mutex_unlock(&THR_LOCK_net);
+  return resumed;
+}
+
+
+void vio_ssl_save_session(struct st_VioSSLFd *fd, const char *peer, SSL *ssl)
+{
+  struct st_VioSSLSessionCache *cache;
+  struct st_VioSSLSession *slot= NULL;
+  SSL_SESSION *session;
+  char *peer_copy;
+  uint i;
+
+  /* A resumed session is already cached, keep its original creation time */
+  if (!peer || SSL_session_reused(ssl))
+    return;
+
+  if (!(session= SSL_get1_session(ssl)))
+    return;
+  if (!(peer_copy= my_strdup(peer, MYF(MY_WME))))
+  {
+    SSL_SESSION_free(session);
+    return;
+  }
+
+  mysql_mutex_lock(&THR_LOCK_net);
+  if (!(cache= fd->session_cache))
+  {
+    mysql_mutex_unlock(&THR_LOCK_net);
+    my_free(peer_copy);
+    SSL_SESSION_free(session);
+    return;
+  }
+  for (i= 0; i < SSL_SESSION_SLOTS; i++)
+  {
+    if (cache->sessions[i].peer && !strcmp(cache->sessions[i].peer, peer))
+    {
+      slot= &cache->sessions[i];
+      break;
+    }
+  }
+  if (!slot)
+  {
+    slot= &cache->sessions[cache->next_slot];
+    cache->next_slot= (cache->next_slot + 1) % SSL_SESSION_SLOTS;
+  }
+  clear_session(slot);
+  slot->peer= peer_copy;
+  slot->session= session;
+  slot->created= my_time(0);
+  mysql_mutex_unlock(&THR_LOCK_net);
+}
 #endif /* HAVE_OPENSSL */
@@ -1,5 +1,6 @@
 var EventEmitter = require('events').EventEmitter;
 var inherits = require('util').inherits;
+var inspectCustom = require('util').inspect.custom;
 var lookup = require('dns').lookup;
 var isIP = require('net').isIP;
 var ReadableStream = require('stream').Readable;
@@ -14,16 +15,81 @@ try {
 }
 
 var binding = addon.ClientBinding;
+var groupBinding = addon.ClientGroupBinding;
+var format = addon.format;
 
 var RE_PARAM = /(?:\?)|(?::(\d+|(?:[a-zA-Z][a-zA-Z0-9_]*)))/g;
 var DQUOTE = 34;
 var SQUOTE = 39;
 var BSLASH = 92;
 
+// Statements that may write. Statements that write to tables that cannot be
+// determined (e.g. CALL, or a WITH clause followed by a write) invalidate all
+// cached results.
+var RE_WRITE = new RegExp(
+  '^\\s*(?:INSERT|REPLACE|UPDATE|DELETE|TRUNCATE|ALTER|DROP|RENAME|LOAD|CALL'
+    + '|EXECUTE)\\b'
+  + '|^\\s*WITH\\b[\\s\\S]*\\b(?:INSERT|REPLACE|UPDATE|DELETE)\\b',
+  'i'
+);
+// Captures the (first) table written to and the rest of the statement, which
+// is checked against RE_WRITE_TAIL to make sure no other table is written to
+var RE_WRITE_TABLE = new RegExp(
+  '^\\s*(?:'
+    + '(?:INSERT|REPLACE)(?:\\s+(?:LOW_PRIORITY|DELAYED|HIGH_PRIORITY|IGNORE))*'
+      + '(?:\\s+INTO)?'
+    + '|UPDATE(?:\\s+(?:LOW_PRIORITY|IGNORE))*'
+    + '|DELETE(?:\\s+(?:LOW_PRIORITY|QUICK|IGNORE))*\\s+FROM'
+    + '|TRUNCATE(?:\\s+TABLE)?'
+    + '|(?:ALTER|DROP|RENAME)\\s+TABLE(?:\\s+IF\\s+EXISTS)?'
+  + ')\\s+(?:(?:`[^`]+`|[\\w$]+)\\s*\\.\\s*)?(`[^`]+`|[\\w$]+)([\\s\\S]*)$',
+  'i'
+);
+var RE_WRITE_TAIL = {
+  // Only the single-table forms, not e.g. `UPDATE a JOIN b` or `UPDATE a, b`
+  UPDATE: /^(?:\s+(?:AS\s+)?(?!SET\b)(?:`[^`]+`|[\w$]+))?\s+SET\b/i,
+  DELETE: new RegExp(
+    '^(?:\\s+(?:AS\\s+)?'
+      + '(?!(?:WHERE|ORDER|LIMIT|RETURNING|PARTITION|USING)\\b)'
+      + '(?:`[^`]+`|[\\w$]+))?'
+    + '\\s*(?:$|(?:WHERE|ORDER|LIMIT|RETURNING|PARTITION)\\b)',
+    'i'
+  ),
+  TRUNCATE: /^\s*$/,
+  DROP: /^[^,]*$/,
+  RENAME: /^[^,]*$/
+};
+// Queries that may contain comments or more than one statement
+var RE_SQL_SPLIT = /[;#]|--|\/\*/;
+var ERR_TIMEOUT = -2;
+var ER_QUERY_INTERRUPTED = 1317;
+var ER_STATEMENT_TIMEOUT = 1969;
+var RE_MARIADB_VERSION = /^(?:5\.5\.5-)?(\d+)\.(\d+)\.(\d+).*mariadb/i;
+var DEFAULT_DNS_CACHE_TTL = 5000;
+var CONN_ATTEMPT_DELAY = 250;
+// `dns.lookup()` supports returning all addresses since node v1.2.0
+var LOOKUP_ALL = (+process.versions.node.split('.')[0] >= 4);
+var DEFAULT_RESULT_CACHE_SIZE = 16 * 1024 * 1024;
+var DEFAULT_RESULT_CACHE_TTL = 1000;
+// Must be kept in sync with the NUMBERS_* flags in src/binding.cc
+var NUMBERS_BIGINT_NUMBER = 1;
+var NUMBERS_BIGINT_BIGINT = 2;
+var NUMBERS_DECIMAL_BIGINT = 4;
+var NUMBERS_DATES_NUMBER = 8;
+var NUMBERS_DATES_BIGINT = 16;
+var NUMBERS_DATES_DATE = 32;
+// Offsets are limited to the widest range servers accept, -13:59 to +14:00
+// (MariaDB itself only accepts -12:59 to +13:00)
+var RE_TIMEZONE = /^(?:local|Z|[+-](?:0\d|1[0-3]):[0-5]\d|\+14:00)$/;
+
+var EMPTY_FN = function() {};
 var EMPTY_LRU_FN = function(key, value) {};
+var RESULT_SIZE_FN = function(entry) { return entry.size; };
 
 Client.escape = addon.escape;
 Client.version = addon.version;
+Client.Group = ClientGroup;
+Client.fanout = fanout;
 
 function Client(config) {
   if (!(this instanceof Client))
@@ -47,40 +113,60 @@ function Client(config) {
   if (this._config.queryCache !== false && !queryCache)
     queryCache = new LRU({ max: ncache, dispose: EMPTY_LRU_FN });
 
+  var priorities = 1;
+  if (typeof this._config.priorities === 'number'
+      && this._config.priorities > 1) {
+    priorities = Math.floor(this._config.priorities);
+  }
+  var aging = 0;
+  if (typeof this._config.priorityAging === 'number'
+      && this._config.priorityAging > 0) {
+    aging = this._config.priorityAging;
+  }
+
+  var resultCache;
+  var rcConfig = this._config.resultCache;
+  if (rcConfig) {
+    if (typeof rcConfig !== 'object')
+      rcConfig = {};
+    resultCache = new LRU({
+      max: (typeof rcConfig.maxSize === 'number'
+            ? rcConfig.maxSize
+            : DEFAULT_RESULT_CACHE_SIZE),
+      length: RESULT_SIZE_FN,
+      dispose: EMPTY_LRU_FN
+    });
+    this._resultCacheTTL = (typeof rcConfig.ttl === 'number'
+                            ? rcConfig.ttl
+                            : DEFAULT_RESULT_CACHE_TTL);
+    this._resultCacheSWR = (typeof rcConfig.staleWhileRevalidate === 'number'
+                            ? rcConfig.staleWhileRevalidate
+                            : 0);
+  }
+
   this._req = undefined;
-  this._queue = [];
+  this._queue = new RequestQueue(priorities, aging);
   this._queryCache = queryCache;
+  this._resultCache = resultCache;
+  this._inflight = undefined;
+  this._race = undefined;
+  this._resolvedHost = undefined;
+  // The address actually connected to, which the control connection must use
+  // as well
+  this._connectedHost = undefined;
+  this._control = undefined;
+  this._stmtTimeout = undefined;
+  this._killById = undefined;
   this._handleClosing = false;
-  this._tmrInactive = undefined;
-  this._tmrPingWaitRes = undefined;
+  // Whether the connection is being dropped because of a query timeout
+  this._timeoutClose = false;
+  this._pingState = PING_NONE;
+  this._pingDue = 0;
+  this._pingSlot = -1;
   this.connecting = false;
   this.connected = false;
   this.closing = false;
   this.threadId = undefined;
-
-  if (this._config.threadId === false)
-    return;
-
-  // XXX: hack to get thread ID first before any other queries
-  var self = this;
-  this._firstQuery = {
-    str: 'SELECT CONNECTION_ID()',
-    cb: function(err, rows) {
-      if (err) {
-        self.emit('error', err);
-        self.close(true);
-        return;
-      }
-      self.threadId = rows[0][0];
-      self.connecting = false;
-      self.connected = true;
-      self.emit('ready');
-    },
-    result: undefined,
-    results: undefined,
-    needMetadata: false,
-    needColumns: false
-  };
 }
 inherits(Client, EventEmitter);
 
@@ -91,6 +177,7 @@ Client.prototype._initHandle = function() {
   this._handle = new binding({
     context: this,
     config: this._config,
+    group: groupHandle(this._config),
     onconnect: this._onconnect,
     onerror: this._onerror,
     onidle: this._onidle,
@@ -99,6 +186,7 @@ Client.prototype._initHandle = function() {
     onresultend: this._onresultend,
     onping: this._onping,
     onclose: this._onclose,
+    ontimeout: this._ontimeout
   });
 }
 
@@ -130,6 +218,11 @@ Client.prototype.connect = function(config, cb) {
   var self = this;
   if (typeof cfg !== 'object')
     throw new Error('Missing config');
+  if (cfg.timezone !== undefined
+      && (typeof cfg.timezone !== 'string'
+          || !RE_TIMEZONE.test(cfg.timezone))) {
+    throw new Error('Invalid timezone: ' + cfg.timezone);
+  }
 
   this.connecting = true;
 
@@ -137,26 +230,36 @@ Client.prototype.connect = function(config, cb) {
     // Doing a manual resolve prevents libmariadbclient from doing a blocking
     // DNS resolve
     self._initHandle();
-    if (!isIP(cfg.host)) {
-      lookup(cfg.host, function(err, address, family) {
+    if (!cfg.unixSocket && cfg.host && !isIP(cfg.host)) {
+      var ttl = (typeof cfg.dnsCache === 'number'
+                 ? cfg.dnsCache
+                 : DEFAULT_DNS_CACHE_TTL);
+      resolveHost(cfg.host, ttl, function(err, addresses) {
         if (err) {
           self.connecting = false;
           self.emit('error', err);
           return self.emit('close');
         }
-        cfg = clone(cfg);
-        cfg.host = address;
-        self._handle.connect(cfg);
+        self._resolvedHost = cfg.host;
+        if (addresses.length > 1) {
+          new ConnectRace(self, cfg, addresses).start();
+        } else {
+          cfg = clone(cfg);
+          cfg.host = self._connectedHost = addresses[0];
+          self._handle.connect(cfg);
+        }
       });
-    } else
+    } else {
+      self._connectedHost = cfg.host;
       self._handle.connect(cfg);
+    }
   });
 };
 
 Client.prototype.query = function(str, values, config, cb) {
   var req;
   var ret;
-  if (typeof str !== 'string')
+  if (typeof str !== 'string' && !Buffer.isBuffer(str))
     throw new Error('Missing query string');
   if (typeof values === 'function') {
     // query(str, cb)
@@ -176,8 +279,11 @@ Client.prototype.query = function(str, values, config, cb) {
     values = undefined;
   }
 
-  if (Array.isArray(values) || (typeof values === 'object' && values !== null))
+  if (typeof str === 'string'
+      && (Array.isArray(values)
+          || (typeof values === 'object' && values !== null))) {
     str = this.prepare(str)(values);
+  }
 
   var needColumns = (!config ||
                      (typeof config === 'object'
@@ -185,6 +291,59 @@ Client.prototype.query = function(str, values, config, cb) {
                       && !config.useArray));
   var needMetadata = ((config && config.metadata === true)
                       || this._config.metadata === true);
+  var invalidates;
+  var cacheResult = false;
+  var deadline = (config && config.timeout > 0 ? Date.now() + config.timeout : 0);
+  var serverTimeout = !!(config && config.serverTimeout);
+  var numbers = getNumbers(config);
+
+  var cacheKey;
+
+  if (this._resultCache !== undefined) {
+    invalidates = getInvalidations(typeof str === 'string'
+                                   ? str
+                                   : str.toString('utf8'));
+    if (invalidates !== undefined) {
+      // Queries that write are never served from (or added to) the cache
+      this._invalidateResults(invalidates);
+    } else if (typeof str === 'string'
+               && typeof cb === 'function'
+               && config
+               && config.cache
+               && numbers === 0) {
+      // Options that change the shape of the rows are part of the key
+      cacheKey = (needColumns ? (config.lazy ? 'l' : 'o') : 'a') + str;
+      if (!config._revalidate
+          && this._getCachedResult(cacheKey, str, config, needMetadata, cb)) {
+        return;
+      }
+      cacheResult = true;
+    }
+  }
+  if (typeof cb === 'function'
+      && typeof str === 'string'
+      && config
+      && config.coalesce === true) {
+    var key = (needColumns ? (config.lazy ? 'l' : 'o') : 'a')
+              + (needMetadata ? 'm' : '-') + numbers + str;
+    if (this._inflight === undefined)
+      this._inflight = {};
+    else if (this._inflight[key] !== undefined) {
+      // An identical query is already queued or running, share its result
+      this._inflight[key].push(cb);
+      return;
+    }
+    cb = this._coalesceCb(key, cb);
+  } else {
+    // Queries enqueued after any non-coalesced query (which may be a write)
+    // must not share results with queries enqueued before it
+    this._inflight = undefined;
+  }
+  if (cacheResult) {
+    // Table names from the metadata are needed for invalidation
+    cb = this._cacheResultCb(cacheKey, config, needMetadata, cb);
+    needMetadata = true;
+  }
   if (typeof cb === 'function') {
     // We are buffering all rows
     req = {
@@ -192,28 +351,88 @@ Client.prototype.query = function(str, values, config, cb) {
       result: undefined,
       results: undefined,
       metadata: undefined,
+      lazy: (needColumns && !!(config && config.lazy)),
 
       str: str,
       needColumns: needColumns,
       needMetadata: needMetadata,
-      rowBuilder: undefined
+      numbers: numbers,
+      rowBuilder: undefined,
+      queuedAt: 0,
+      invalidates: invalidates,
+      deadline: deadline,
+      serverTimeout: serverTimeout,
+      timedOut: false
     };
   } else {
     // We are streaming all rows
     var hwm = (config && config.hwm) || this._config.streamHWM;
     req = {
-      emitter: new ResultEmitter(this._handle, hwm),
+      emitter: new ResultEmitter(this, hwm),
       stream: undefined,
 
       str: str,
       needColumns: needColumns,
       needMetadata: needMetadata,
-      rowBuilder: undefined
+      numbers: numbers,
+      rowBuilder: undefined,
+      queuedAt: 0,
+      invalidates: invalidates,
+      deadline: deadline,
+      serverTimeout: serverTimeout,
+      timedOut: false,
+      iter: undefined
     };
     ret = req.emitter;
   }
 
-  this._queue.push(req);
+  this._enqueue(req, (config && config.priority) || 0);
+
+  return ret;
+};
+
+Client.prototype.iterate = function(str, values, config) {
+  if (typeof Promise !== 'function')
+    throw new Error('iterate() requires Promise support');
+  if (typeof str !== 'string' && !Buffer.isBuffer(str))
+    throw new Error('Missing query string');
+
+  if (typeof str === 'string'
+      && (Array.isArray(values)
+          || (typeof values === 'object' && values !== null))) {
+    str = this.prepare(str)(values);
+  }
+
+  var needColumns = (!config || !config.useArray);
+  var needMetadata = ((config && config.metadata === true)
+                      || this._config.metadata === true);
+  var batchSize = (config && config.batchSize > 0 ? config.batchSize : 100);
+  var iter = new RowIterator(this, batchSize);
+  this._inflight = undefined;
+  var req = {
+    emitter: undefined,
+    stream: undefined,
+
+    str: str,
+    needColumns: needColumns,
+    needMetadata: needMetadata,
+    numbers: getNumbers(config),
+    rowBuilder: undefined,
+    queuedAt: 0,
+    invalidates: undefined,
+    deadline: (config && config.timeout > 0 ? Date.now() + config.timeout : 0),
+    serverTimeout: !!(config && config.serverTimeout),
+    timedOut: false,
+    iter: iter
+  };
+
+  this._enqueue(req, (config && config.priority) || 0);
+
+  return iter;
+};
+
+Client.prototype._enqueue = function(req, priority) {
+  this._queue.push(req, priority);
 
   if (!this.connected)
     this.connect();
@@ -223,14 +442,157 @@ Client.prototype.query = function(str, values, config, cb) {
       self._processQueue(false);
     });
   }
+};
 
-  return ret;
+Client.prototype.changeUser = function(options, cb) {
+  if (typeof options !== 'object' || options === null)
+    throw new Error('Missing options');
+  var user = (typeof options.user === 'string' ? options.user : null);
+  var password = (typeof options.password === 'string'
+                  ? options.password
+                  : null);
+  var db = (typeof options.db === 'string' ? options.db : null);
+  var self = this;
+  this._command(function(handle) {
+    handle.changeUser(user, password, db);
+  }, true, function(err) {
+    if (!err) {
+      // Make sure reconnects use the new account and database
+      var cfg = clone(self._config);
+      if (user !== null)
+        cfg.user = user;
+      if (password !== null)
+        cfg.password = password;
+      if (db !== null)
+        cfg.db = db;
+      self._config = cfg;
+    }
+    if (typeof cb === 'function')
+      cb(err);
+  });
+};
+
+Client.prototype.reset = function(cb) {
+  this._command(function(handle) {
+    handle.changeUser(null, null, null);
+  }, true, cb);
+};
+
+Client.prototype.selectDb = function(db, cb) {
+  if (typeof db !== 'string')
+    throw new Error('Missing database name');
+  var self = this;
+  this._command(function(handle) {
+    handle.selectDb(db);
+  }, false, function(err) {
+    if (!err) {
+      var cfg = clone(self._config);
+      cfg.db = db;
+      self._config = cfg;
+    }
+    if (typeof cb === 'function')
+      cb(err);
+  });
+};
+
+// Enqueues a request that runs `op` instead of a query. Commands change the
+// session, so cached and coalesced results from before them cannot be reused.
+// If `newSession` is true, the connection's init commands are run again after
+// `op` succeeds, since mysql_change_user() does not run them.
+Client.prototype._command = function(op, newSession, cb) {
+  var self = this;
+  this._inflight = undefined;
+  function done(err) {
+    if (typeof cb === 'function')
+      cb(err || null);
+  }
+  var req = {
+    cb: function(err) {
+      if (!err && self._resultCache !== undefined)
+        self._resultCache.reset();
+      if (!err && newSession)
+        self._runInitCommands(done);
+      else
+        done(err);
+    },
+    result: undefined,
+    results: undefined,
+    metadata: undefined,
+    lazy: false,
+
+    str: undefined,
+    needColumns: false,
+    needMetadata: false,
+    numbers: 0,
+    rowBuilder: undefined,
+    queuedAt: 0,
+    invalidates: undefined,
+    deadline: 0,
+    serverTimeout: false,
+    timedOut: false,
+    op: op
+  };
+  this._enqueue(req, 0);
+};
+
+// Queues the init commands (including the one for `timezone`) ahead of all
+// other requests. This is called from a request's callback, before the next
+// request is dispatched.
+Client.prototype._runInitCommands = function(cb) {
+  var cfg = this._config;
+  var cmds = [];
+  if (typeof cfg.initCommands === 'string')
+    cmds.push(cfg.initCommands);
+  else if (Array.isArray(cfg.initCommands)) {
+    for (var i = 0; i < cfg.initCommands.length; ++i) {
+      if (typeof cfg.initCommands[i] === 'string')
+        cmds.push(cfg.initCommands[i]);
+    }
+  }
+  if (typeof cfg.timezone === 'string' && cfg.timezone !== 'local') {
+    cmds.push("SET time_zone = '"
+              + (cfg.timezone === 'Z' ? '+00:00' : cfg.timezone)
+              + "'");
+  }
+  if (cmds.length === 0)
+    return cb(null);
+
+  var left = cmds.length;
+  var error = null;
+  function oncmd(err) {
+    if (err && error === null)
+      error = err;
+    if (--left === 0)
+      cb(error);
+  }
+  for (var j = cmds.length - 1; j >= 0; --j) {
+    this._queue.unshift({
+      cb: oncmd,
+      result: undefined,
+      results: undefined,
+      metadata: undefined,
+      lazy: false,
+
+      str: cmds[j],
+      needColumns: false,
+      needMetadata: false,
+      numbers: 0,
+      rowBuilder: undefined,
+      queuedAt: 0,
+      invalidates: undefined,
+      deadline: 0,
+      serverTimeout: false,
+      timedOut: false
+    });
+  }
 };
 
 Client.prototype.close = function(force) {
   if (!this.closing && (this.connected || this.connecting)) {
     this.closing = true;
-    if (force || (this._req === undefined && this._queue.length === 0)) {
+    if (this._race !== undefined)
+      this._race.cancel();
+    else if (force || (this._req === undefined && this._queue.length === 0)) {
       this._handleClosing = true;
       this._handle.close();
     }
@@ -256,21 +618,13 @@ Client.prototype.abort = function(killConn, cb) {
 
   var kind = (killConn ? 'CONNECTION' : 'QUERY');
   var querystr = 'KILL ' + kind + ' ' + this.threadId;
-  var calledBack = false;
-
-  var abortClient = new Client(this._config);
-  abortClient._firstQuery = null;
-  abortClient.on('error', handler);
-  abortClient.connect(function() {
-    abortClient.query(querystr, handler);
-    abortClient.end();
-  });
-  function handler(err) {
-    if (calledBack)
-      return;
-    calledBack = true;
+
+  if (this._control === undefined)
+    this._control = acquireControlClient(this._config,
+                                         this._connectedHost);
+  this._control.query(querystr, function(err) {
     cb && cb(err);
-  }
+  });
 };
 
 Client.prototype.isMariaDB = function() {
@@ -293,6 +647,18 @@ Client.prototype.serverVersion = function() {
   return this._handle.serverVersion();
 };
 
+Client.prototype.memoryUsage = function() {
+  if (this._handle === null)
+    return { result: 0, net: 0, context: 0, query: 0, total: 0 };
+  return this._handle.memoryUsage();
+};
+
+Client.prototype.trace = function() {
+  if (this._handle === null)
+    return [];
+  return this._handle.trace();
+};
+
 Client.prototype.prepare = function(query) {
   var cache = this._queryCache;
   var cqfn;
@@ -350,18 +716,8 @@ Client.prototype.prepare = function(query) {
     if (tokens.length) {
       if (end < query.length)
         parts.push(query.slice(start));
-      var self = this;
       fn = function(values) {
-        var ret = '';
-        for (var j = 0, t = 0; j < tokens.length; ++j) {
-          ret += parts[j];
-          if (tokens[j] === null)
-            continue;
-          ret += self._format_value(values[tokens[j]]);
-        }
-        if (j < parts.length)
-          ret += parts[j];
-        return ret;
+        return format(parts, tokens, values);
       };
       var cache = this._queryCache;
       cache && cache.set(query, fn);
@@ -371,21 +727,202 @@ Client.prototype.prepare = function(query) {
   return function() { return query; };
 };
 
-Client.prototype._onconnect = function() {
-  var queue = this._queue;
-  if (queue.length === 0 || queue[0] !== this._firstQuery) {
-    if (this._firstQuery)
-      queue.unshift(this._firstQuery);
-    else {
-      this.connecting = false;
-      this.connected = true;
-      this.emit('ready');
+Client.prototype._getCachedResult = function(key, str, config, needMetadata,
+                                             cb) {
+  var entry = this._resultCache.get(key);
+  if (entry === undefined)
+    return false;
+  var now = Date.now();
+  if (now >= entry.expires) {
+    if (now >= entry.staleUntil) {
+      this._resultCache.del(key);
+      return false;
+    }
+    if (!entry.refreshing) {
+      // Serve the stale result while fetching a fresh copy in the background
+      entry.refreshing = true;
+      this.query(str,
+                 null,
+                 { cache: config.cache,
+                   staleWhileRevalidate: config.staleWhileRevalidate,
+                   useArray: config.useArray,
+                   lazy: config.lazy,
+                   priority: config.priority,
+                   _revalidate: true },
+                 function(err) {
+        entry.refreshing = false;
+      });
     }
   }
+  var rows = (needMetadata ? entry.rows : entry.rowsNoMetadata);
+  process.nextTick(function() {
+    cb(null, rows);
+  });
+  return true;
+};
+
+Client.prototype._cacheResultCb = function(key, config, needMetadata, cb) {
+  var self = this;
+  return function(err, rows) {
+    if (err || rows.info === undefined || rows.info.metadata === undefined) {
+      // Errors, multi-result set responses, and responses without a result
+      // set are never cached
+      return cb(err, rows);
+    }
+    var metadata = rows.info.metadata;
+    var tables = [];
+    var keys = Object.keys(metadata);
+    for (var i = 0, table; i < keys.length; ++i) {
+      table = metadata[keys[i]].org_table;
+      if (table && tables.indexOf(table.toLowerCase()) === -1)
+        tables.push(table.toLowerCase());
+    }
+
+    // Cached results are shared by all callers (including ones that ask for
+    // metadata later on), so the full result is kept along with a copy of it
+    // without metadata for those who did not ask for it
+    var rowsNoMetadata = rows.slice();
+    rowsNoMetadata.info = clone(rows.info);
+    rowsNoMetadata.info.metadata = undefined;
+
+    var ttl = (typeof config.cache === 'number'
+               ? config.cache
+               : self._resultCacheTTL);
+    var swr = (typeof config.staleWhileRevalidate === 'number'
+               ? config.staleWhileRevalidate
+               : self._resultCacheSWR);
+    var now = Date.now();
+    self._resultCache.set(key, {
+      rows: rows,
+      rowsNoMetadata: rowsNoMetadata,
+      tables: tables,
+      size: key.length * 2 + estimateResultSize(rows),
+      expires: now + ttl,
+      staleUntil: now + ttl + swr,
+      refreshing: false
+    });
+    cb(err, (needMetadata ? rows : rowsNoMetadata));
+  };
+};
+
+Client.prototype._coalesceCb = function(key, cb) {
+  var inflight = this._inflight;
+  var waiting = inflight[key] = [];
+  return function(err, rows) {
+    if (inflight[key] === waiting)
+      delete inflight[key];
+    var len = waiting.length;
+    if (len > 0 && !err)
+      freezeResult(rows);
+    cb(err, rows);
+    for (var i = 0; i < len; ++i)
+      waiting[i](err, rows);
+  };
+};
+
+// `table` is either a (lowercase) table name or `true` to invalidate all
+// cached results
+Client.prototype._invalidateResults = function(table) {
+  var cache = this._resultCache;
+  if (table === true)
+    return cache.reset();
+  var keys = [];
+  cache.forEach(function(entry, key) {
+    if (entry.tables.indexOf(table) !== -1)
+      keys.push(key);
+  });
+  for (var i = 0; i < keys.length; ++i)
+    cache.del(keys[i]);
+};
+
+Client.prototype._onconnect = function(threadId) {
+  this._stmtTimeout = undefined;
+  this._killById = undefined;
+  if (this._config.threadId !== false)
+    this.threadId = threadId;
+  this.connecting = false;
+  this.connected = true;
+  this.emit('ready');
   this._processQueue(true);
 };
 
+Client.prototype._ontimeout = function() {
+  var req = this._req;
+  if (req === undefined || req.timedOut)
+    return;
+  req.timedOut = true;
+  if (typeof this.threadId === 'string'
+      && this.threadId.length
+      && this._supportsKillQueryId()) {
+    this._killRequest(req);
+  } else if (!this._handleClosing) {
+    // Killing by thread id could hit a later query if `req` finishes before
+    // the KILL arrives, so drop the connection instead. `req` fails with the
+    // timeout error and any queued requests are sent on a new connection
+    // (unless the connection was being closed already).
+    this._timeoutClose = !this.closing;
+    this.closing = false;
+    this.close(true);
+  }
+};
+
+// Kills the statement that `req` is running by its query id. The query id is
+// looked up on the control connection and is only used if `req` is still the
+// current request when the answer arrives: since the next request is not sent
+// until then, the id can only belong to one of `req`'s statements.
+Client.prototype._killRequest = function(req) {
+  var self = this;
+  if (this._control === undefined)
+    this._control = acquireControlClient(this._config,
+                                         this._connectedHost);
+  var control = this._control;
+  control.query('SELECT QUERY_ID FROM information_schema.PROCESSLIST '
+                + 'WHERE ID = ' + this.threadId,
+                null,
+                { useArray: true },
+                function(err, rows) {
+    if (err || self._req !== req || rows.length === 0)
+      return;
+    control.query('KILL QUERY ID ' + rows[0][0], EMPTY_FN);
+  });
+};
+
+function isMariaDBAtLeast(version, major, minor, patch) {
+  var m = RE_MARIADB_VERSION.exec(version);
+  return (m !== null
+          && (+m[1] > major
+              || (+m[1] === major
+                  && (+m[2] > minor
+                      || (+m[2] === minor && +m[3] >= patch)))));
+}
+
+Client.prototype._supportsStatementTimeout = function() {
+  // SET STATEMENT ... FOR was added in MariaDB 10.1.2
+  if (this._stmtTimeout === undefined) {
+    this._stmtTimeout = isMariaDBAtLeast(this._handle.serverVersion(),
+                                         10, 1, 2);
+  }
+  return this._stmtTimeout;
+};
+
+Client.prototype._supportsKillQueryId = function() {
+  // KILL QUERY ID and PROCESSLIST.QUERY_ID were added in MariaDB 10.0.5
+  if (this._killById === undefined) {
+    this._killById = isMariaDBAtLeast(this._handle.serverVersion(),
+                                      10, 0, 5);
+  }
+  return this._killById;
+};
+
 Client.prototype._onerror = function(err) {
+  var cur = this._req;
+  if (cur !== undefined && cur.deadline > 0
+      && ((cur.timedOut && err.code === ER_QUERY_INTERRUPTED)
+          || err.code === ER_STATEMENT_TIMEOUT)) {
+    err = makeTimeoutError();
+    // Reported here, so _finishReq() does not need to report it again
+    cur.timedOut = false;
+  }
   if (isDeadConn(err.code)) {
     this.connecting = this.connected = false;
     this.emit('error', err);
@@ -399,36 +936,62 @@ Client.prototype._onerror = function(err) {
           req.results = [err];
         else
           results.push(err);
+      } else if (req.iter !== undefined) {
+        req.iter._error(err);
       } else {
-        var stream = req.stream;
-        if (stream === undefined) {
-          var emitter = req.emitter;
-          stream = emitter._createStream();
-          emitter.emit('result', stream);
-          stream.emit('error', err);
-          stream.push(null);
-          stream.read(0);
-        } else {
-          stream.emit('error', err);
-          stream.push(null);
-          req.stream = undefined;
-        }
+        streamError(req, err);
       }
     } else
       this.emit('error', err);
   }
 };
 
+function streamError(req, err) {
+  var stream = req.stream;
+  if (stream === undefined) {
+    var emitter = req.emitter;
+    stream = emitter._createStream();
+    emitter.emit('result', stream);
+    stream.emit('error', err);
+    stream.push(null);
+    stream.read(0);
+  } else {
+    stream.emit('error', err);
+    stream.push(null);
+    req.stream = undefined;
+  }
+}
+
 Client.prototype._onidle = function() {
+  this._finishReq();
+  this._processQueue(false);
+};
+
+// Delivers the final result (or error) of the current request
+Client.prototype._finishReq = function() {
   var req = this._req;
   if (req) {
     // A query finished -- no more result sets
-    this._queue.shift();
     this._req = undefined;
+    if (req.invalidates !== undefined)
+      this._invalidateResults(req.invalidates);
     var cb = req.cb;
+    if (req.timedOut) {
+      // Killed queries do not necessarily end in an error (e.g. SLEEP()), so
+      // make sure the timeout is reported either way
+      if (cb !== undefined)
+        return cb(makeTimeoutError());
+      if (req.iter !== undefined)
+        req.iter._error(makeTimeoutError());
+      else
+        streamError(req, makeTimeoutError());
+    }
     if (cb !== undefined) {
       var results = req.results;
-      if (results.length === 1) {
+      if (results === undefined) {
+        // Successful command without a result set (e.g. changeUser())
+        cb(null);
+      } else if (results.length === 1) {
         // Single result set response
 
         var r = results[0];
@@ -443,6 +1006,8 @@ Client.prototype._onidle = function() {
         // results ended in error (can this even happen in reality?)
         cb(null, results);
       }
+    } else if (req.iter !== undefined) {
+      req.iter._end();
     } else {
       // Signal to the emitter that when the last QueryStream ends, that it's ok
       // to emit 'end' as well ...
@@ -451,14 +1016,16 @@ Client.prototype._onidle = function() {
         req.emitter._complete(req.stream);
     }
   }
-  this._processQueue(false);
 };
 
-Client.prototype._onresultinfo = function(cols, metadata) {
+Client.prototype._onresultinfo = function(cols, metadata, lazy) {
   var req = this._req;
   if (req.cb !== undefined) {
     if (req.needMetadata)
       req.metadata = createMetadata(metadata);
+  } else if (req.iter !== undefined) {
+    if (req.needMetadata)
+      req.iter.info.metadata = createMetadata(metadata);
   } else {
     var emitter = req.emitter;
     var stream = req.stream = emitter._createStream();
@@ -466,19 +1033,35 @@ Client.prototype._onresultinfo = function(cols, metadata) {
       stream.info.metadata = createMetadata(metadata);
     emitter.emit('result', stream);
   }
-  if (req.needColumns)
-    req.rowBuilder = createRowBuilder(cols);
+  if (req.needColumns) {
+    // The binding may fall back to regular rows even if lazy rows were
+    // requested
+    req.rowBuilder = (lazy === true
+                      ? createLazyRowType(cols)
+                      : createRowBuilder(cols));
+  }
 };
 
-Client.prototype._onrow = function(row) {
+Client.prototype._onrow = function(row, nRows) {
   var req = this._req;
   var builder = req.rowBuilder;
   if (req.cb !== undefined) {
-    if (builder) {
+    if (nRows !== undefined) {
+      // `row` is a native lazy result, `builder` the lazy row type
+      var rows = new Array(nRows);
+      for (var r = 0; r < nRows; ++r)
+        rows[r] = new builder(row, r);
+      row = rows;
+    } else if (builder) {
       for (var i = 0; i < row.length; ++i)
         row[i] = builder(row[i]);
     }
     req.result = row;
+  } else if (req.iter !== undefined) {
+    if (builder)
+      row = builder(row);
+    if (req.iter._push(row) === false)
+      this._handle.pause();
   } else {
     if (builder)
       row = builder(row);
@@ -523,6 +1106,11 @@ Client.prototype._onresultend = function(numRows, affectedRows, insertId) {
       results.push(result);
     else
       req.results = [result];
+  } else if (req.iter !== undefined) {
+    var info = req.iter.info;
+    info.numRows = numRows;
+    info.affectedRows = affectedRows;
+    info.insertId = insertId;
   } else {
     var stream = req.stream;
     if (stream === undefined) {
@@ -545,39 +1133,60 @@ Client.prototype._onresultend = function(numRows, affectedRows, insertId) {
 };
 
 Client.prototype._onping = function() {
-  clearTimeout(this._tmrPingWaitRes);
-  this._tmrPingWaitRes = undefined;
-  this._tmrInactive = undefined;
+  this._pingState = PING_NONE;
   if (this._queue.length === 0)
     this._ping();
+  else
+    this._processQueue(false);
 };
 
 Client.prototype._onclose = function(err) {
   var self = this;
-  clearTimeout(this._tmrInactive);
-  clearTimeout(this._tmrPingWaitRes);
-  this._tmrInactive = undefined;
-  this._tmrPingWaitRes = undefined;
+  this._pingState = PING_NONE;
+  if (this.connecting && this._resolvedHost !== undefined) {
+    // Make sure the next connection attempt picks up any DNS changes (e.g.
+    // after a failover)
+    invalidateHost(this._resolvedHost);
+  }
+  this._resolvedHost = undefined;
+  this._connectedHost = undefined;
+  if (this._control !== undefined) {
+    releaseControlClient(this._control);
+    this._control = undefined;
+  }
   this.connecting = false;
   this.connected = false;
   this.closing = false;
   this._handleClosing = false;
 
-  var keepQueries = this._config.keepQueries;
+  var timeoutClose = this._timeoutClose;
+  this._timeoutClose = false;
+  if (this._req !== undefined && this._req.timedOut) {
+    // Report the timeout rather than the connection closing, since that may
+    // be why the connection was closed
+    this._finishReq();
+  }
+
+  var keepQueries = (timeoutClose || this._config.keepQueries);
   if (keepQueries === false || keepQueries === undefined) {
     if (this._req !== undefined)
       this._queue.unshift(this._req);
-    cleanupReqs(this._queue, err);
-    this._queue = [];
+    cleanupReqs(this._queue.toArray(), err);
+    this._queue.clear();
   } else if (this._req !== undefined) {
-    // No easy way to "recover" the current request, so just remove it and clean
-    // it up
-    cleanupReqs([this._queue.shift()], err);
+    // No easy way to "recover" the current request, so just clean it up
+    cleanupReqs([this._req], err);
   }
   this._req = undefined;
   if (!err)
     this.emit('end');
   this.emit('close');
+  if (timeoutClose
+      && this._queue.length > 0
+      && !this.connecting
+      && !this.connected) {
+    this.connect();
+  }
   // Allow addon handle to be garbage collected since we are no longer connected
   // See: https://github.com/mscdex/node-mariasql/pull/130
   //      https://github.com/mscdex/node-mariasql/pull/133
@@ -601,16 +1210,46 @@ Client.prototype._processQueue = function(ignoreConnected) {
   var queue = this._queue;
   if (queue.length > 0) {
     // Allow an outstanding ping request to finish first
-    if (this._tmrPingWaitRes !== undefined)
+    if (this._pingState === PING_WAIT)
+      return;
+    // The ping wheel drops clients that are no longer idle when it gets to them
+    this._pingState = PING_NONE;
+
+    while (queue.length > 0) {
+      req = this._req = queue.shift();
+      if (req.op !== undefined) {
+        req.op(this._handle);
+        return;
+      }
+      var timeout = 0;
+      if (req.deadline > 0) {
+        timeout = req.deadline - Date.now();
+        if (timeout <= 0) {
+          // Timed out while still queued
+          this._onerror(makeTimeoutError());
+          this._finishReq();
+          if (!this.connected)
+            return;
+          continue;
+        }
+      }
+      var str = req.str;
+      if (req.serverTimeout && typeof str === 'string' && timeout > 0
+          && this._supportsStatementTimeout()) {
+        // Have the server enforce the deadline as well
+        str = 'SET STATEMENT max_statement_time=' + (timeout / 1000) + ' FOR '
+              + str;
+      }
+      this._handle.query(str,
+                         req.needColumns,
+                         req.needMetadata,
+                         req.cb !== undefined,
+                         req.lazy === true,
+                         timeout,
+                         req.numbers);
       return;
-    clearTimeout(this._tmrInactive);
-    this._tmrInactive = undefined;
-
-    req = this._req = queue[0];
-    this._handle.query(req.str,
-                       req.needColumns,
-                       req.needMetadata,
-                       req.cb !== undefined);
+    }
+    this._processQueue(ignoreConnected);
   } else if (connected) {
     if (this.closing && !this._handleClosing) {
       this._handleClosing = true;
@@ -624,53 +1263,41 @@ function pingNoAnswer(self) {
   self.emit('error', new Error('Ping response lost'));
   self.close(true);
 }
-function pingCb(self) {
-  self._tmrPingWaitRes = setTimeout(pingNoAnswer,
-                                    self._config.pingWaitRes,
-                                    self);
-  self._handle.ping();
-}
 Client.prototype._ping = function() {
-  if (this._tmrInactive === undefined
+  if (this._pingState === PING_NONE
       && typeof this._config.pingInactive === 'number'
       && typeof this._config.pingWaitRes === 'number'
       && this._config.pingInactive > 0
       && this._config.pingWaitRes > 0) {
-    this._tmrInactive = setTimeout(pingCb, this._config.pingInactive, this);
+    this._pingState = PING_IDLE;
+    this._pingDue = Date.now() + this._config.pingInactive;
+    pingWheel.add(this);
   }
 };
 
 Client.prototype._format_value = function(v) {
-  if (Buffer.isBuffer(v))
-    return "X'" + v.toString('hex') + "'";
-  else if (Array.isArray(v)) {
-    var r = [];
-    for (var i = 0, len = v.length; i < len; ++i)
-      r.push(this._format_value(v[i]));
-    return r.join(',');
-  } else if (v !== null && v !== undefined)
-    return "'" + Client.escape(v + '') + "'";
-
-  return 'NULL';
+  return format([], [0], [v]);
 };
 
 
 
 var QueryStreamDefaultOpts = { objectMode: true };
-function ResultEmitter(handle, hwm) {
+// Streams hold the client rather than its handle because a connection race
+// can replace client._handle after they are created
+function ResultEmitter(client, hwm) {
   EventEmitter.call(this);
   if (typeof hwm === 'number')
     this._streamOpts = { objectMode: true, highWaterMark: hwm };
   else
     this._streamOpts = QueryStreamDefaultOpts;
-  this._handle = handle;
+  this._client = client;
   this._done = false;
   this._waitingForEnd = false;
 }
 inherits(ResultEmitter, EventEmitter);
 
 ResultEmitter.prototype._createStream = function() {
-  var qs = new QueryStream(this._handle, this._streamOpts);
+  var qs = new QueryStream(this._client, this._streamOpts);
   var self = this;
   this._waitingForEnd = true;
   qs.on('end', function() {
@@ -696,9 +1323,9 @@ ResultEmitter.prototype._complete = function(qs) {
   }
 };
 
-function QueryStream(handle, opts) {
+function QueryStream(client, opts) {
   ReadableStream.call(this, opts);
-  this._handle = handle;
+  this._client = client;
   this._needResume = false;
   this.info = {
     numRows: undefined,
@@ -711,8 +1338,1108 @@ inherits(QueryStream, ReadableStream);
 QueryStream.prototype._read = function(n) {
   if (this._needResume) {
     this._needResume = false;
-    this._handle.resume();
+    var handle = this._client._handle;
+    if (handle)
+      handle.resume();
+  }
+};
+
+
+
+// Connections used for sending KILL commands, shared by all clients using the
+// same server and account. Control connections are opened to the address the
+// client is connected to rather than its (possibly resolving to several
+// servers) host name, as a thread id is only meaningful on the server it came
+// from. A control connection is created on the first
+// abort() and closed once all clients that have used it have closed. Its
+// queue serializes the KILL commands and it reconnects by itself if the server
+// closes it in the meantime.
+var controlClients = {};
+
+function acquireControlClient(cfg, host) {
+  var key = JSON.stringify([
+    cfg.unixSocket, host, cfg.port, cfg.user, cfg.password
+  ]);
+  var ctl = controlClients[key];
+  if (ctl === undefined) {
+    var ctlcfg = clone(cfg);
+    ctlcfg.host = host;
+    ctlcfg.db = undefined;
+    ctlcfg.initCommands = undefined;
+    ctlcfg.keepQueries = false;
+    ctlcfg.resultCache = undefined;
+    ctlcfg.pingInactive = undefined;
+    ctlcfg.group = undefined;
+    ctl = controlClients[key] = new Client(ctlcfg);
+    ctl._controlKey = key;
+    ctl._controlUsers = 0;
+    // Errors for KILL commands are passed to the abort() callbacks instead
+    ctl.on('error', EMPTY_FN);
+  }
+  ++ctl._controlUsers;
+  return ctl;
+}
+
+function releaseControlClient(ctl) {
+  if (--ctl._controlUsers === 0) {
+    if (controlClients[ctl._controlKey] === ctl)
+      delete controlClients[ctl._controlKey];
+    ctl.end();
+  }
+}
+
+// Resolved addresses (and lookups in progress) per host name, shared by all
+// clients so that many clients (re)connecting at once do not each occupy a
+// threadpool thread with the same lookup
+var dnsCache = {};
+
+function resolveHost(host, ttl, cb) {
+  var entry = dnsCache[host];
+  if (entry !== undefined) {
+    if (entry.waiting !== undefined) {
+      entry.waiting.push(cb);
+      return;
+    }
+    if (Date.now() < entry.expires) {
+      var addresses = entry.addresses;
+      process.nextTick(function() {
+        cb(null, addresses);
+      });
+      return;
+    }
+  }
+
+  entry = dnsCache[host] = {
+    addresses: undefined,
+    expires: 0,
+    waiting: [cb]
+  };
+  function done(err, addresses) {
+    var waiting = entry.waiting;
+    entry.waiting = undefined;
+    if (err || ttl <= 0) {
+      if (dnsCache[host] === entry)
+        delete dnsCache[host];
+    } else {
+      entry.addresses = addresses;
+      entry.expires = Date.now() + ttl;
+    }
+    for (var i = 0; i < waiting.length; ++i)
+      waiting[i](err, addresses);
+  }
+  if (LOOKUP_ALL) {
+    lookup(host, { all: true }, function(err, addresses) {
+      if (!err && addresses.length === 0) {
+        err = new Error('No addresses found for ' + host);
+        err.code = 'ENOTFOUND';
+      }
+      done(err, err ? undefined : interleaveFamilies(addresses));
+    });
+  } else {
+    lookup(host, function(err, address) {
+      done(err, err ? undefined : [address]);
+    });
+  }
+}
+
+function invalidateHost(host) {
+  var entry = dnsCache[host];
+  if (entry !== undefined && entry.waiting === undefined)
+    delete dnsCache[host];
+}
+
+// Orders addresses so that address families alternate, starting with the
+// family of the first (preferred) address
+function interleaveFamilies(addresses) {
+  var first = [];
+  var other = [];
+  var ret = [];
+  var family = addresses[0].family;
+  for (var i = 0; i < addresses.length; ++i) {
+    if (addresses[i].family === family)
+      first.push(addresses[i].address);
+    else
+      other.push(addresses[i].address);
+  }
+  for (var j = 0; j < first.length || j < other.length; ++j) {
+    if (j < first.length)
+      ret.push(first[j]);
+    if (j < other.length)
+      ret.push(other[j]);
+  }
+  return ret;
+}
+
+// Connects to the first of several addresses that answers. A new attempt is
+// started whenever the previous one fails or has not succeeded within
+// CONN_ATTEMPT_DELAY milliseconds, with earlier attempts left running. The
+// first attempt to connect becomes the client's handle and all others are
+// closed.
+function ConnectRace(client, cfg, addresses) {
+  this.client = client;
+  this.cfg = cfg;
+  this.addresses = addresses;
+  this.next = 0;
+  this.attempts = [];
+  this.pending = 0;
+  this.err = undefined;
+  this.timer = undefined;
+  this.done = false;
+}
+
+ConnectRace.prototype.start = function() {
+  this.client._race = this;
+  this._attempt();
+};
+
+ConnectRace.prototype._attempt = function() {
+  clearTimeout(this.timer);
+  this.timer = undefined;
+  if (this.next >= this.addresses.length)
+    return;
+  var cfg = clone(this.cfg);
+  cfg.host = this.addresses[this.next++];
+  var attempt = new ConnectAttempt(this, cfg);
+  this.attempts.push(attempt);
+  ++this.pending;
+  attempt.handle.connect(cfg);
+  if (this.next < this.addresses.length)
+    this.timer = setTimeout(raceNextAttempt, CONN_ATTEMPT_DELAY, this);
+};
+
+function raceNextAttempt(race) {
+  race.timer = undefined;
+  race._attempt();
+}
+
+ConnectRace.prototype._finish = function() {
+  this.done = true;
+  clearTimeout(this.timer);
+  this.timer = undefined;
+  this.client._race = undefined;
+};
+
+ConnectRace.prototype._won = function(winner, threadId) {
+  this._finish();
+  var attempts = this.attempts;
+  for (var i = 0; i < attempts.length; ++i) {
+    if (attempts[i] !== winner && !attempts[i].closed)
+      attempts[i].handle.close();
+  }
+  winner.won = true;
+  this.client._handle = winner.handle;
+  this.client._connectedHost = winner.host;
+  this.client._onconnect(threadId);
+};
+
+ConnectRace.prototype._failed = function() {
+  --this.pending;
+  if (this.done)
+    return;
+  if (this.next < this.addresses.length)
+    this._attempt();
+  else if (this.pending === 0) {
+    var client = this.client;
+    var err = this.err;
+    if (err === undefined) {
+      err = new Error('Unable to connect to any address of ' + this.cfg.host);
+      err.code = -1;
+    }
+    this._finish();
+    invalidateHost(this.cfg.host);
+    client._onerror(err);
+    // Errors for dead connections already close the client
+    if (client.connecting)
+      client._onclose();
+  }
+};
+
+ConnectRace.prototype.cancel = function() {
+  this._finish();
+  var attempts = this.attempts;
+  for (var i = 0; i < attempts.length; ++i) {
+    if (!attempts[i].closed)
+      attempts[i].handle.close();
+  }
+  var client = this.client;
+  process.nextTick(function() {
+    client._onclose();
+  });
+};
+
+// Binding callback context for a single connection attempt. Once the attempt
+// has won, callbacks are forwarded to the client.
+function ConnectAttempt(race, cfg) {
+  this.race = race;
+  this.host = cfg.host;
+  this.won = false;
+  this.closed = false;
+  this.handle = new binding({
+    context: this,
+    config: cfg,
+    group: groupHandle(cfg),
+    onconnect: this._onconnect,
+    onerror: this._onerror,
+    onidle: forwardToClient('_onidle'),
+    onresultinfo: forwardToClient('_onresultinfo'),
+    onrow: forwardToClient('_onrow'),
+    onresultend: forwardToClient('_onresultend'),
+    onping: forwardToClient('_onping'),
+    onclose: this._onclose,
+    ontimeout: forwardToClient('_ontimeout')
+  });
+}
+
+ConnectAttempt.prototype._onconnect = function(threadId) {
+  if (!this.race.done)
+    this.race._won(this, threadId);
+  else
+    this.handle.close();
+};
+
+ConnectAttempt.prototype._onerror = function(err) {
+  if (this.won)
+    this.race.client._onerror(err);
+  else
+    this.race.err = err;
+};
+
+ConnectAttempt.prototype._onclose = function() {
+  if (this.won)
+    return this.race.client._onclose();
+  if (!this.closed) {
+    this.closed = true;
+    this.race._failed();
+  }
+};
+
+function forwardToClient(name) {
+  return function() {
+    var client = this.race.client;
+    return client[name].apply(client, arguments);
+  };
+}
+
+
+
+// Delivers the callbacks of all member clients in one native -> JS call per
+// event loop iteration. The native side queues [callback, context, argc,
+// args...] entries, see ClientGroup in the binding.
+function ClientGroup() {
+  if (!(this instanceof ClientGroup))
+    return new ClientGroup();
+  this._handle = new groupBinding(dispatchBatch);
+}
+
+function dispatchBatch(batch) {
+  dispatchFrom(batch, 0);
+}
+
+function dispatchFrom(batch, i) {
+  var len = batch.length;
+  try {
+    while (i < len) {
+      var fn = batch[i];
+      var ctx = batch[i + 1];
+      var argc = batch[i + 2];
+      i += 3 + argc;
+      switch (argc) {
+        case 0: fn.call(ctx); break;
+        case 1: fn.call(ctx, batch[i - 1]); break;
+        case 2: fn.call(ctx, batch[i - 2], batch[i - 1]); break;
+        default: fn.call(ctx, batch[i - 3], batch[i - 2], batch[i - 1]);
+      }
+    }
+  } finally {
+    // Do not lose the other clients' callbacks if one of them throws
+    if (i < len) {
+      process.nextTick(function() {
+        dispatchFrom(batch, i);
+      });
+    }
+  }
+}
+
+function groupHandle(cfg) {
+  var group = cfg.group;
+  if (group === undefined || group === null)
+    return undefined;
+  if (!(group instanceof ClientGroup))
+    throw new Error('group must be a Client.Group instance');
+  return group._handle;
+}
+
+// A process-wide hashed timer wheel driving idle pings for all clients with a
+// single timer. Clients only update their ping state and due time when they
+// go idle or busy. Entries are (re)checked when the wheel reaches their slot:
+// clients that are no longer idle are dropped, clients that are not yet due
+// are moved to a later slot, and all due clients are pinged together.
+var PING_NONE = 0;
+var PING_IDLE = 1;
+var PING_WAIT = 2;
+var PING_WHEEL_TICK = 100;
+var PING_WHEEL_SLOTS = 256;
+
+function PingWheel(tick, nslots) {
+  this._tick = tick;
+  this._mask = nslots - 1;
+  this._slots = new Array(nslots);
+  for (var i = 0; i < nslots; ++i)
+    this._slots[i] = [];
+  this._start = 0;
+  this._cur = 0;
+  this._count = 0;
+  this._timer = undefined;
+}
+
+PingWheel.prototype.add = function(client) {
+  if (client._pingSlot !== -1)
+    return; // Already in the wheel, it will be moved when its slot comes up
+  ++this._count;
+  if (this._timer === undefined)
+    this._startTimer();
+  this._insert(client);
+};
+
+PingWheel.prototype._insert = function(client) {
+  var t = Math.ceil((client._pingDue - this._start) / this._tick);
+  if (t <= this._cur)
+    t = this._cur + 1;
+  var slot = t & this._mask;
+  client._pingSlot = slot;
+  this._slots[slot].push(client);
+};
+
+PingWheel.prototype._startTimer = function() {
+  var self = this;
+  this._start = Date.now();
+  this._cur = 0;
+  this._timer = setInterval(function() {
+    self._advance();
+  }, this._tick);
+  if (typeof this._timer.unref === 'function')
+    this._timer.unref();
+};
+
+PingWheel.prototype._advance = function() {
+  var now = Date.now();
+  var target = Math.floor((now - this._start) / this._tick);
+  // Visit each slot at most once even if the timer was delayed
+  if (target - this._cur > this._mask + 1)
+    this._cur = target - (this._mask + 1);
+  var due = [];
+  var lost = [];
+  while (this._cur < target) {
+    var slot = (++this._cur) & this._mask;
+    var clients = this._slots[slot];
+    if (clients.length === 0)
+      continue;
+    this._slots[slot] = [];
+    for (var i = 0, client; i < clients.length; ++i) {
+      client = clients[i];
+      client._pingSlot = -1;
+      if (client._pingState === PING_NONE) {
+        --this._count;
+      } else if (now < client._pingDue) {
+        this._insert(client);
+      } else if (client._pingState === PING_IDLE) {
+        due.push(client);
+      } else {
+        --this._count;
+        client._pingState = PING_NONE;
+        lost.push(client);
+      }
+    }
+  }
+
+  // Send all pings that became due during this tick in one batch
+  for (var j = 0, c; j < due.length; ++j) {
+    c = due[j];
+    c._pingState = PING_WAIT;
+    c._pingDue = now + c._config.pingWaitRes;
+    this._insert(c);
+    c._handle.ping();
+  }
+
+  if (this._count === 0) {
+    clearInterval(this._timer);
+    this._timer = undefined;
+  }
+
+  for (var k = 0; k < lost.length; ++k)
+    pingNoAnswer(lost[k]);
+};
+
+var pingWheel = new PingWheel(PING_WHEEL_TICK, PING_WHEEL_SLOTS);
+
+
+
+// Async iterator yielding arrays of up to `batchSize` rows. Rows from all
+// result sets of a query are yielded in order. The connection is paused
+// whenever a full batch is waiting to be consumed.
+function RowIterator(client, batchSize) {
+  this._client = client;
+  this._batchSize = batchSize;
+  this._batch = [];
+  this._ready = [];
+  this._waiting = [];
+  this._err = undefined;
+  this._done = false;
+  this._paused = false;
+  this._discard = false;
+  this.info = {
+    numRows: undefined,
+    affectedRows: undefined,
+    insertId: undefined,
+    metadata: undefined
+  };
+}
+if (typeof Symbol === 'function' && Symbol.asyncIterator) {
+  RowIterator.prototype[Symbol.asyncIterator] = function() {
+    return this;
+  };
+}
+
+// Returns false when the connection should be paused
+RowIterator.prototype._push = function(row) {
+  if (this._discard)
+    return true;
+  var batch = this._batch;
+  batch.push(row);
+  if (batch.length < this._batchSize)
+    return true;
+  this._batch = [];
+  if (this._waiting.length > 0) {
+    this._waiting.shift().resolve({ value: batch, done: false });
+    return true;
+  }
+  this._ready.push(batch);
+  this._paused = true;
+  return false;
+};
+
+RowIterator.prototype._error = function(err) {
+  if (this._err === undefined && !this._discard)
+    this._err = err;
+};
+
+RowIterator.prototype._end = function() {
+  if (this._done)
+    return;
+  this._done = true;
+  if (this._batch.length > 0) {
+    this._ready.push(this._batch);
+    this._batch = [];
+  }
+  var waiting = this._waiting;
+  while (waiting.length > 0)
+    this._settle(waiting.shift());
+};
+
+RowIterator.prototype._settle = function(p) {
+  if (this._ready.length > 0) {
+    p.resolve({ value: this._ready.shift(), done: false });
+  } else if (this._err !== undefined) {
+    var err = this._err;
+    this._err = undefined;
+    this._discard = true;
+    p.reject(err);
+  } else if (this._done) {
+    p.resolve({ value: undefined, done: true });
+  } else {
+    this._waiting.push(p);
+    this._resume();
+  }
+};
+
+RowIterator.prototype._resume = function() {
+  if (this._paused) {
+    this._paused = false;
+    var handle = this._client._handle;
+    if (handle)
+      handle.resume();
+  }
+};
+
+RowIterator.prototype.next = function() {
+  var self = this;
+  return new Promise(function(resolve, reject) {
+    self._settle({ resolve: resolve, reject: reject });
+    if (self._ready.length === 0)
+      self._resume();
+  });
+};
+
+RowIterator.prototype.return = function(value) {
+  // Drain and drop any remaining rows so the connection can move on
+  this._discard = true;
+  this._ready = [];
+  this._batch = [];
+  this._err = undefined;
+  this._resume();
+  return Promise.resolve({ value: value, done: true });
+};
+
+
+
+// Merges the rows of the same query sent to several connections at once (e.g.
+// one per shard). Without an `orderBy` column, rows are passed through in the
+// order they arrive. Otherwise each shard is expected to return its rows
+// already sorted on that column and a binary heap holding the head row of
+// every shard is used to produce a single sorted stream.
+var NUMERIC_TYPES = {
+  TINYINT: true, SMALLINT: true, INTEGER: true, MEDIUMINT: true,
+  BIGINT: true, DECIMAL: true, YEAR: true
+};
+var FLOAT_TYPES = { FLOAT: true, DOUBLE: true };
+
+function fanout(clients, str, values, options, cb) {
+  if (!Array.isArray(clients) || clients.length === 0)
+    throw new Error('Missing clients');
+  if (typeof str !== 'string')
+    throw new Error('Missing query string');
+  // Arguments are handled like they are for query(): `options` can only be
+  // passed after `values`
+  if (typeof values === 'function') {
+    // fanout(clients, str, cb)
+    cb = values;
+    values = options = undefined;
+  } else if (typeof options === 'function') {
+    // fanout(clients, str, values, cb)
+    cb = options;
+    options = undefined;
+  }
+  if (Array.isArray(values) || (typeof values === 'object' && values !== null))
+    str = clients[0].prepare(str)(values);
+  if (typeof options !== 'object' || options === null)
+    options = {};
+
+  var stream = new FanoutStream(clients, str, options);
+  if (typeof cb === 'function') {
+    var rows = [];
+    stream.on('data', function(row) {
+      rows.push(row);
+    }).on('error', function(err) {
+      if (cb !== undefined) {
+        var fn = cb;
+        cb = undefined;
+        fn(err);
+      }
+    }).on('end', function() {
+      if (cb !== undefined)
+        cb(null, rows);
+    });
+    return;
+  }
+  return stream;
+}
+
+function FanoutStream(clients, str, options) {
+  ReadableStream.call(this, {
+    objectMode: true,
+    highWaterMark: (options.hwm > 0 ? options.hwm : 16)
+  });
+  // The query is sent as is: appending a LIMIT clause breaks queries that
+  // already end in one (or in e.g. FOR UPDATE), and wrapping the query in a
+  // derived table would allow the server to drop its ORDER BY
+  var limit = options.limit;
+  if (typeof limit === 'number' && limit >= 0 && isFinite(limit)) {
+    limit = Math.floor(limit);
+  } else {
+    limit = -1;
+  }
+  this._limit = limit;
+  this._count = 0;
+  this._useArray = !!options.useArray;
+  this._ordered = (options.orderBy !== undefined && options.orderBy !== null);
+  this._orderBy = options.orderBy;
+  this._desc = !!options.desc;
+  this._compare = (typeof options.compare === 'function'
+                   ? options.compare
+                   : undefined);
+  this._col = undefined;
+  this._reading = false;
+  this._finished = false;
+  this._shards = new Array(clients.length);
+  // Shards that have not ended yet and currently have no row in the heap (or,
+  // without `orderBy`, all shards that have not ended yet)
+  this._waiting = [];
+  this._heap = [];
+  // Shard at the top of the heap whose row was passed on last
+  this._top = undefined;
+
+  var qcfg = {
+    useArray: this._useArray,
+    metadata: this._ordered,
+    hwm: options.shardHwm,
+    priority: options.priority,
+    timeout: options.timeout
+  };
+  for (var i = 0; i < clients.length; ++i) {
+    var shard = new FanoutShard(this, i);
+    this._shards[i] = shard;
+    this._waiting.push(shard);
+    shard.start(clients[i], str, qcfg);
+  }
+}
+inherits(FanoutStream, ReadableStream);
+
+FanoutStream.prototype._read = function(n) {
+  this._reading = true;
+  this._pump();
+};
+
+// Resolves the sort column and the comparison to use for it, once the first
+// result set (and its metadata) is available
+FanoutStream.prototype._setup = function(qs) {
+  var orderBy = this._orderBy;
+  var metadata = qs.info.metadata;
+  var names = (metadata ? Object.keys(metadata) : undefined);
+  var idx = orderBy;
+  if (typeof orderBy === 'string')
+    idx = (names ? names.indexOf(orderBy) : -1);
+  if (this._useArray) {
+    if (typeof idx !== 'number' || idx < 0)
+      throw new Error('Unknown orderBy column: ' + orderBy);
+    this._col = idx;
+  } else if (typeof orderBy === 'string') {
+    this._col = orderBy;
+  } else {
+    if (!names || idx < 0 || idx >= names.length)
+      throw new Error('Unknown orderBy column: ' + orderBy);
+    this._col = names[idx];
+  }
+  if (this._compare === undefined) {
+    var type = (names && idx >= 0 && idx < names.length
+                ? metadata[names[idx]].type
+                : undefined);
+    if (NUMERIC_TYPES[type] === true)
+      this._compare = compareDecimal;
+    else if (FLOAT_TYPES[type] === true)
+      this._compare = compareFloat;
+    else
+      this._compare = compareValues;
+  }
+};
+
+FanoutStream.prototype._less = function(a, b) {
+  var r = this._compare(a.key, b.key);
+  if (this._desc)
+    r = -r;
+  // Ties are broken on the shard index to keep the output deterministic
+  return (r < 0 || (r === 0 && a.index < b.index));
+};
+
+FanoutStream.prototype._heapPush = function(shard) {
+  var heap = this._heap;
+  var i = heap.length;
+  heap.push(shard);
+  while (i > 0) {
+    var parent = (i - 1) >> 1;
+    if (!this._less(shard, heap[parent]))
+      break;
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = shard;
+};
+
+// Moves `shard` from the top of the heap down to where it belongs
+FanoutStream.prototype._siftDown = function(shard) {
+  var heap = this._heap;
+  var len = heap.length;
+  var i = 0;
+  while (true) {
+    var child = 2 * i + 1;
+    if (child >= len)
+      break;
+    if (child + 1 < len && this._less(heap[child + 1], heap[child]))
+      ++child;
+    if (!this._less(heap[child], shard))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = shard;
+};
+
+FanoutStream.prototype._heapPop = function() {
+  var heap = this._heap;
+  var top = heap[0];
+  var last = heap.pop();
+  if (heap.length > 0)
+    this._siftDown(last);
+  return top;
+};
+
+FanoutStream.prototype._pump = function() {
+  if (this._finished)
+    return;
+  if (this._ordered)
+    this._pumpOrdered();
+  else
+    this._pumpUnordered();
+};
+
+FanoutStream.prototype._pumpOrdered = function() {
+  var waiting = this._waiting;
+  var shard;
+  var row;
+  while (this._reading) {
+    if (this._count === this._limit)
+      return this._finish();
+    // A row can only be passed on once every shard that has not ended yet
+    // has a row in the heap
+    while (waiting.length > 0) {
+      shard = waiting[waiting.length - 1];
+      row = shard.read();
+      if (row === null) {
+        if (!shard.done)
+          return;
+        waiting.pop();
+        if (shard === this._top) {
+          this._top = undefined;
+          this._heapPop();
+        }
+        continue;
+      }
+      if (this._col === undefined) {
+        try {
+          this._setup(shard.stream);
+        } catch (ex) {
+          return this._fail(ex);
+        }
+      }
+      waiting.pop();
+      shard.row = row;
+      shard.key = row[this._col];
+      if (shard === this._top) {
+        // Replacing the top row directly takes half the comparisons of
+        // popping it and pushing the next row
+        this._top = undefined;
+        this._siftDown(shard);
+      } else {
+        this._heapPush(shard);
+      }
+    }
+    if (this._heap.length === 0)
+      return this._finish();
+    // The shard stays at the top of the heap until its next row is read
+    shard = this._top = this._heap[0];
+    row = shard.row;
+    shard.row = shard.key = undefined;
+    waiting.push(shard);
+    ++this._count;
+    this._reading = this.push(row);
+  }
+};
+
+FanoutStream.prototype._pumpUnordered = function() {
+  var waiting = this._waiting;
+  var i = 0;
+  while (this._reading) {
+    if (this._count === this._limit)
+      return this._finish();
+    if (waiting.length === 0)
+      return this._finish();
+    if (i >= waiting.length) {
+      // Nothing is available from any shard right now
+      return;
+    }
+    var shard = waiting[i];
+    var row = shard.read();
+    if (row === null) {
+      if (shard.done)
+        waiting.splice(i, 1);
+      else
+        ++i;
+      continue;
+    }
+    ++this._count;
+    this._reading = this.push(row);
+  }
+};
+
+FanoutStream.prototype._finish = function() {
+  this._finished = true;
+  this._drain();
+  this.push(null);
+};
+
+FanoutStream.prototype._fail = function(err) {
+  if (this._finished)
+    return;
+  this._finished = true;
+  this._drain();
+  this.emit('error', err);
+};
+
+// Discards any remaining rows so that every connection can move on
+FanoutStream.prototype._drain = function() {
+  var shards = this._shards;
+  this._heap = [];
+  this._top = undefined;
+  this._waiting = [];
+  for (var i = 0; i < shards.length; ++i) {
+    shards[i].row = shards[i].key = undefined;
+    shards[i].discard();
+  }
+};
+
+function FanoutShard(fanout, index) {
+  this.fanout = fanout;
+  this.index = index;
+  this.stream = undefined;
+  this.done = false;
+  this.row = undefined;
+  this.key = undefined;
+  this._readable = false;
+  this._onreadable = undefined;
+}
+
+FanoutShard.prototype.start = function(client, str, qcfg) {
+  var self = this;
+  var fanout = this.fanout;
+  this._onreadable = function() {
+    self._readable = true;
+    fanout._pump();
+  };
+  client.query(str, null, qcfg).on('result', function(qs) {
+    qs.on('error', function(err) {
+      fanout._fail(err);
+    });
+    if (self.stream !== undefined || fanout._finished) {
+      // Only the first result set of each shard is used
+      qs.resume();
+      return;
+    }
+    self.stream = qs;
+    self._readable = true;
+    qs.on('readable', self._onreadable);
+  }).on('end', function() {
+    self.done = true;
+    fanout._pump();
+  });
+};
+
+// A stream is only read again once it has emitted 'readable' after returning
+// no row. Besides saving calls, this matters for a stream that has ended but
+// not emitted 'end' yet, as every read() of it schedules another 'end' check.
+FanoutShard.prototype.read = function() {
+  if (!this._readable)
+    return null;
+  var row = this.stream.read();
+  if (row === null)
+    this._readable = false;
+  return row;
+};
+
+FanoutShard.prototype.discard = function() {
+  var qs = this.stream;
+  if (qs !== undefined) {
+    qs.removeListener('readable', this._onreadable);
+    qs.resume();
+  }
+};
+
+function compareValues(a, b) {
+  // NULLs sort first, like they do with ORDER BY ... ASC
+  if (a === null || a === undefined)
+    return (b === null || b === undefined ? 0 : -1);
+  if (b === null || b === undefined)
+    return 1;
+  return (a < b ? -1 : (a > b ? 1 : 0));
+}
+
+function compareFloat(a, b) {
+  if (a === null || b === null || typeof a !== 'string')
+    return compareValues(a, b);
+  return compareValues(+a, +b);
+}
+
+// Compares exact numeric values given as strings without converting them to
+// doubles first, so that BIGINT and DECIMAL values keep their full precision
+function compareDecimal(a, b) {
+  if (typeof a !== 'string' || typeof b !== 'string')
+    return compareValues(a, b);
+  var negA = (a.charCodeAt(0) === 45);
+  var negB = (b.charCodeAt(0) === 45);
+  if (negA !== negB)
+    return (negA ? -1 : 1);
+  var r = compareAbsDecimal(negA ? a.slice(1) : a, negB ? b.slice(1) : b);
+  return (negA ? -r : r);
+}
+
+function compareAbsDecimal(a, b) {
+  var dotA = a.indexOf('.');
+  var dotB = b.indexOf('.');
+  var intA = (dotA === -1 ? a.length : dotA);
+  var intB = (dotB === -1 ? b.length : dotB);
+  var i = 0;
+  var j = 0;
+  var ca;
+  var cb;
+  while (i < intA - 1 && a.charCodeAt(i) === 48)
+    ++i;
+  while (j < intB - 1 && b.charCodeAt(j) === 48)
+    ++j;
+  if (intA - i !== intB - j)
+    return (intA - i < intB - j ? -1 : 1);
+  if (i === 0 && j === 0 && dotA === -1 && dotB === -1) {
+    // Integers with the same number of digits compare like strings
+    return (a < b ? -1 : (a > b ? 1 : 0));
+  }
+  for (; i < intA; ++i, ++j) {
+    ca = a.charCodeAt(i);
+    cb = b.charCodeAt(j);
+    if (ca !== cb)
+      return (ca < cb ? -1 : 1);
+  }
+  // Missing fractional digits count as zeros
+  var lenA = a.length;
+  var lenB = b.length;
+  for (i = intA + 1, j = intB + 1; i < lenA || j < lenB; ++i, ++j) {
+    ca = (i < lenA ? a.charCodeAt(i) : 48);
+    cb = (j < lenB ? b.charCodeAt(j) : 48);
+    if (ca !== cb)
+      return (ca < cb ? -1 : 1);
+  }
+  return 0;
+}
+
+
+
+// A growable FIFO ring buffer with O(1) push/shift/unshift
+function Ring() {
+  this._buf = new Array(8);
+  this._mask = 7;
+  this._head = 0;
+  this.length = 0;
+}
+Ring.prototype._grow = function() {
+  var buf = this._buf;
+  var len = buf.length;
+  var newBuf = new Array(len * 2);
+  for (var i = 0; i < len; ++i)
+    newBuf[i] = buf[(this._head + i) & this._mask];
+  this._buf = newBuf;
+  this._mask = newBuf.length - 1;
+  this._head = 0;
+};
+Ring.prototype.push = function(val) {
+  if (this.length === this._buf.length)
+    this._grow();
+  this._buf[(this._head + this.length) & this._mask] = val;
+  ++this.length;
+};
+Ring.prototype.unshift = function(val) {
+  if (this.length === this._buf.length)
+    this._grow();
+  this._head = (this._head - 1) & this._mask;
+  this._buf[this._head] = val;
+  ++this.length;
+};
+Ring.prototype.shift = function() {
+  if (this.length === 0)
+    return;
+  var val = this._buf[this._head];
+  this._buf[this._head] = undefined;
+  this._head = (this._head + 1) & this._mask;
+  --this.length;
+  return val;
+};
+Ring.prototype.peek = function() {
+  if (this.length === 0)
+    return;
+  return this._buf[this._head];
+};
+Ring.prototype.toArray = function(ret) {
+  for (var i = 0; i < this.length; ++i)
+    ret.push(this._buf[(this._head + i) & this._mask]);
+  return ret;
+};
+
+// Request queue with one or more priority lanes (0 being the highest). Lower
+// lanes are only served when all higher lanes are empty, unless the request
+// at the head of a lower lane has been waiting for at least `aging`
+// milliseconds.
+function RequestQueue(lanes, aging) {
+  this._lanes = new Array(lanes);
+  for (var i = 0; i < lanes; ++i)
+    this._lanes[i] = new Ring();
+  this._aging = aging;
+  // Number of requests that were put back at the very front of the queue
+  this._nfront = 0;
+  this.length = 0;
+}
+RequestQueue.prototype.push = function(req, lane) {
+  var lanes = this._lanes;
+  if (lane < 0 || lane !== lane)
+    lane = 0;
+  else if (lane >= lanes.length)
+    lane = lanes.length - 1;
+  else
+    lane |= 0;
+  if (this._aging > 0 && lanes.length > 1)
+    req.queuedAt = Date.now();
+  lanes[lane].push(req);
+  ++this.length;
+};
+RequestQueue.prototype.unshift = function(req) {
+  this._lanes[0].unshift(req);
+  ++this._nfront;
+  ++this.length;
+};
+RequestQueue.prototype._nextLane = function() {
+  var lanes = this._lanes;
+  var nlanes = lanes.length;
+  var lane = 0;
+  if (this._nfront > 0)
+    return 0;
+  while (lane < nlanes && lanes[lane].length === 0)
+    ++lane;
+  if (lane === nlanes)
+    return -1;
+  if (this._aging > 0 && lane < nlanes - 1) {
+    // Let the oldest starving request from a lower lane jump ahead
+    var now = Date.now();
+    var oldest = now - this._aging;
+    for (var i = lane + 1, head; i < nlanes; ++i) {
+      head = lanes[i].peek();
+      if (head !== undefined && head.queuedAt <= oldest) {
+        oldest = head.queuedAt;
+        lane = i;
+      }
+    }
   }
+  return lane;
+};
+RequestQueue.prototype.peek = function() {
+  var lane = this._nextLane();
+  if (lane === -1)
+    return;
+  return this._lanes[lane].peek();
+};
+RequestQueue.prototype.shift = function() {
+  var lane = this._nextLane();
+  if (lane === -1)
+    return;
+  if (this._nfront > 0)
+    --this._nfront;
+  --this.length;
+  return this._lanes[lane].shift();
+};
+RequestQueue.prototype.toArray = function() {
+  var ret = [];
+  for (var i = 0; i < this._lanes.length; ++i)
+    this._lanes[i].toArray(ret);
+  return ret;
+};
+RequestQueue.prototype.clear = function() {
+  for (var i = 0; i < this._lanes.length; ++i)
+    this._lanes[i] = new Ring();
+  this._nfront = 0;
+  this.length = 0;
 };
 
 
@@ -728,6 +2455,193 @@ function clone(obj) {
   return ret;
 }
 
+// Results shared between coalesced queries are made read-only so that one
+// caller cannot modify what another caller sees
+function freezeResult(rows) {
+  for (var i = 0, row; i < rows.length; ++i) {
+    row = rows[i];
+    if (row !== null && typeof row === 'object') {
+      if (row.info !== undefined && Array.isArray(row))
+        freezeResult(row); // Multi-result set response
+      else
+        Object.freeze(row);
+    }
+  }
+  if (rows.info !== undefined) {
+    if (rows.info.metadata !== undefined)
+      Object.freeze(rows.info.metadata);
+    Object.freeze(rows.info);
+  }
+  Object.freeze(rows);
+}
+
+// Returns what the query invalidates in the result cache: `undefined` for
+// nothing, a (lowercase) table name, or `true` for all cached results
+function getInvalidations(sql) {
+  var stmts = (RE_SQL_SPLIT.test(sql) ? splitStatements(sql) : [ sql ]);
+  var ret;
+  for (var i = 0, table; i < stmts.length; ++i) {
+    if (!RE_WRITE.test(stmts[i]))
+      continue;
+    var m = RE_WRITE_TABLE.exec(stmts[i]);
+    if (m === null)
+      return true;
+    var tail = RE_WRITE_TAIL[/^\s*(\w+)/.exec(stmts[i])[1].toUpperCase()];
+    if (tail !== undefined && !tail.test(m[2]))
+      return true;
+    table = unquoteIdent(m[1]);
+    if (ret !== undefined && ret !== table)
+      return true;
+    ret = table;
+  }
+  return ret;
+}
+
+// Splits `sql` into statements with comments removed. The contents of
+// executable comments (`/*! ... */` and `/*M! ... */`) are kept since the
+// server runs them.
+function splitStatements(sql) {
+  var stmts = [];
+  var start = 0;
+  var cur = '';
+  var inExec = false;
+  var len = sql.length;
+  var i = 0;
+  var c;
+  var end;
+  while (i < len) {
+    c = sql.charCodeAt(i);
+    if (c === SQUOTE || c === DQUOTE || c === 96) {
+      // Quoted strings and identifiers, with doubled or escaped quotes
+      for (++i; i < len; ++i) {
+        var q = sql.charCodeAt(i);
+        if (q === BSLASH && c !== 96)
+          ++i;
+        else if (q === c) {
+          if (sql.charCodeAt(i + 1) !== c)
+            break;
+          ++i;
+        }
+      }
+      ++i;
+    } else if (c === 59) { // ;
+      stmts.push(cur + sql.slice(start, i));
+      cur = '';
+      start = ++i;
+    } else if (c === 35 // #
+               || (c === 45 // --
+                   && sql.charCodeAt(i + 1) === 45
+                   && (i + 2 === len || sql.charCodeAt(i + 2) <= 32))) {
+      end = sql.indexOf('\n', i);
+      if (end === -1)
+        end = len;
+      cur += sql.slice(start, i) + ' ';
+      start = i = end;
+    } else if (c === 47 && sql.charCodeAt(i + 1) === 42) { // /*
+      cur += sql.slice(start, i) + ' ';
+      var m = /^\/\*M?!\d*/.exec(sql.slice(i, i + 10));
+      if (m !== null) {
+        inExec = true;
+        start = i = i + m[0].length;
+      } else {
+        end = sql.indexOf('*/', i + 2);
+        start = i = (end === -1 ? len : end + 2);
+      }
+    } else if (inExec && c === 42 && sql.charCodeAt(i + 1) === 47) { // */
+      inExec = false;
+      cur += sql.slice(start, i) + ' ';
+      start = i = i + 2;
+    } else {
+      ++i;
+    }
+  }
+  if (start < len)
+    cur += sql.slice(start);
+  stmts.push(cur);
+  return stmts;
+}
+
+function unquoteIdent(name) {
+  if (name.charCodeAt(0) === 96) // `
+    name = name.slice(1, -1);
+  return name.toLowerCase();
+}
+
+// Returns the NUMBERS_* flags for the `bigint`, `decimal`, and `dates` query
+// options
+function getNumbers(config) {
+  if (!config || typeof config !== 'object')
+    return 0;
+  var numbers = 0;
+  switch (config.bigint) {
+    case undefined:
+    case 'string':
+      break;
+    case 'number':
+      numbers |= NUMBERS_BIGINT_NUMBER;
+      break;
+    case 'bigint':
+      numbers |= NUMBERS_BIGINT_BIGINT;
+      break;
+    default:
+      throw new Error('Invalid bigint option: ' + config.bigint);
+  }
+  switch (config.decimal) {
+    case undefined:
+    case 'string':
+      break;
+    case 'bigint':
+      numbers |= NUMBERS_DECIMAL_BIGINT;
+      break;
+    default:
+      throw new Error('Invalid decimal option: ' + config.decimal);
+  }
+  switch (config.dates) {
+    case undefined:
+    case 'string':
+      break;
+    case 'number':
+      numbers |= NUMBERS_DATES_NUMBER;
+      break;
+    case 'bigint':
+      numbers |= NUMBERS_DATES_BIGINT;
+      break;
+    case 'date':
+      numbers |= NUMBERS_DATES_DATE;
+      break;
+    default:
+      throw new Error('Invalid dates option: ' + config.dates);
+  }
+  if (!addon.bigint
+      && (numbers & (NUMBERS_BIGINT_BIGINT
+                     | NUMBERS_DECIMAL_BIGINT
+                     | NUMBERS_DATES_BIGINT))) {
+    throw new Error('BigInt is not supported by this version of node');
+  }
+  return numbers;
+}
+
+function estimateResultSize(rows) {
+  var size = 0;
+  if (rows.length > 0 && rows[0].__result !== undefined) {
+    // Lazy rows: reading their values would convert every cell, so use the
+    // size of the native result instead
+    var ncols = Object.keys(rows[0]).length;
+    return rows[0].__result.size() + rows.length * (64 + ncols * 16);
+  }
+  for (var i = 0, row, keys; i < rows.length; ++i) {
+    row = rows[i];
+    keys = Object.keys(row);
+    size += 64 + keys.length * 16;
+    for (var j = 0, v; j < keys.length; ++j) {
+      v = row[keys[j]];
+      if (typeof v === 'string')
+        size += v.length * 2;
+    }
+  }
+  return size;
+}
+
 function cleanupReqs(queue, err) {
   var len = queue.length;
   if (!err) {
@@ -738,7 +2652,10 @@ function cleanupReqs(queue, err) {
     req = queue[i];
     if (req.cb !== undefined)
       req.cb(err);
-    else {
+    else if (req.iter !== undefined) {
+      req.iter._error(err);
+      req.iter._end();
+    } else {
       req.emitter._done = true;
       var stream = req.stream;
       if (stream && stream.readable) {
@@ -749,6 +2666,12 @@ function cleanupReqs(queue, err) {
   }
 }
 
+function makeTimeoutError() {
+  var err = new Error('Query timed out');
+  err.code = ERR_TIMEOUT;
+  return err;
+}
+
 function isDeadConn(code) {
   return (code === 2006 || code === 2013 || code === 2055);
 }
@@ -760,6 +2683,64 @@ function createRowBuilder(cols) {
   return new Function('v', fn + '}');
 }
 
+// Rows backed by a native result, converting each column value on first
+// access only
+function createLazyRowType(cols) {
+  var ncols = cols.length;
+  // Columns are own enumerable accessors so that lazy rows look like regular
+  // rows to Object.keys(), JSON.stringify(), etc. Duplicate column names
+  // behave like they do for regular rows (the last one wins).
+  var props = {};
+  for (var i = 0; i < ncols; ++i) {
+    props[cols[i]] = {
+      configurable: true,
+      enumerable: true,
+      get: createLazyGetter(i),
+      set: createLazySetter(cols[i])
+    };
+  }
+  function LazyRow(result, index) {
+    Object.defineProperty(this, '__result', { value: result });
+    Object.defineProperty(this, '__index', { value: index });
+    Object.defineProperty(this, '__values', { value: new Array(ncols) });
+    Object.defineProperties(this, props);
+  }
+  function toJSON() {
+    var obj = {};
+    var keys = Object.keys(this);
+    for (var i = 0; i < keys.length; ++i)
+      obj[keys[i]] = this[keys[i]];
+    return obj;
+  }
+  Object.defineProperty(LazyRow.prototype, 'toJSON', { value: toJSON });
+  if (inspectCustom !== undefined)
+    Object.defineProperty(LazyRow.prototype, inspectCustom, { value: toJSON });
+  return LazyRow;
+}
+
+function createLazyGetter(col) {
+  return function() {
+    var values = this.__values;
+    var v = values[col];
+    if (v === undefined)
+      v = values[col] = this.__result.cell(this.__index, col);
+    return v;
+  };
+}
+
+// Assigning to a column replaces it with a plain property, like it would be
+// for a regular row
+function createLazySetter(name) {
+  return function(v) {
+    Object.defineProperty(this, name, {
+      configurable: true,
+      enumerable: true,
+      writable: true,
+      value: v
+    });
+  };
+}
+
 function createMetadata(data) {
   var result = {};
   var len = data.length;
@@ -774,7 +2755,8 @@ function createMetadata(data) {
         charsetnr: data[i++],
         db: data[i++],
         table: data[i++],
-        org_table: data[i++]
+        org_table: data[i++],
+        decimals: data[i++]
       };
     }
     // TODO: need (fastest) way to make fast properties for metadata object
@@ -57,6 +57,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include <string>
 
 // For Pre-VS2015
@@ -64,6 +67,35 @@
 
 #include <mysql.h>
 
+#ifndef _WIN32
+# include <netinet/tcp.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)                                       \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define HAVE_SSE2 1
+# ifdef _MSC_VER
+#  include <intrin.h>
+static inline unsigned int ctz32(unsigned int v) {
+  unsigned long idx;
+  _BitScanForward(&idx, v);
+  return static_cast<unsigned int>(idx);
+}
+# else
+#  define ctz32(v) static_cast<unsigned int>(__builtin_ctz(v))
+# endif
+#else
+# define HAVE_SSE2 0
+#endif
+
+// BigInt::NewFromWords() is available since V8 6.9 (node v11)
+#if V8_MAJOR_VERSION > 6 || (V8_MAJOR_VERSION == 6 && V8_MINOR_VERSION >= 9)
+# define HAVE_BIGINT 1
+#else
+# define HAVE_BIGINT 0
+#endif
+
 using namespace node;
 using namespace v8;
 
@@ -85,6 +117,13 @@ using namespace v8;
                        (f.type == MYSQL_TYPE_STRING)      ||                   \
                        (f.type == MYSQL_TYPE_VAR_STRING)))
 #define IS_DEAD_ERRNO(v) (v == 2006 || v == 2013 || v == 2055)
+// Same as libmariadbclient's default, but passed explicitly so that we know
+// how much memory each connection's async context stack takes up
+#define ASYNC_STACK_SIZE (4096 * 15)
+// Number of trace entries kept per connection (must be a power of 2)
+#define TRACE_SIZE 64
+// Largest query send buffer that is kept around for reuse between queries
+#define QUERY_BUF_KEEP (64 * 1024)
 #define DEFAULT_CIPHER "ECDHE-RSA-AES128-SHA256:AES128-GCM-SHA256:RC4:HIGH"    \
                        ":!MD5:!aNULL:!EDH"
 #define STATES                                                                 \
@@ -97,7 +136,9 @@ using namespace v8;
   X(NEXTRESULT, 6)                                                             \
   X(FREERESULT, 7)                                                             \
   X(STORERESULT, 8)                                                            \
-  X(PING, 9)
+  X(PING, 9)                                                                   \
+  X(CHANGEUSER, 10)                                                            \
+  X(SELECTDB, 11)
 #define EVENT_NAMES                                                            \
   X(connect)                                                                   \
   X(error)                                                                     \
@@ -106,7 +147,8 @@ using namespace v8;
   X(row)                                                                       \
   X(resultend)                                                                 \
   X(ping)                                                                      \
-  X(close)
+  X(close)                                                                     \
+  X(timeout)
 #define FIELD_TYPES                                                            \
   X(TINY, tiny, TINYINT)                                                       \
   X(SHORT, short, SMALLINT)                                                    \
@@ -153,14 +195,44 @@ using namespace v8;
   X(tcpKeepaliveCnt)                                                           \
   X(tcpKeepaliveIntvl)                                                         \
   X(ssl)                                                                       \
-  X(protocol)
+  X(socket)                                                                    \
+  X(protocol)                                                                  \
+  X(externalStringThreshold)                                                   \
+  X(initCommands)                                                              \
+  X(timezone)
 #define CFG_OPTIONS_SSL                                                        \
   X(key)                                                                       \
   X(cert)                                                                      \
   X(ca)                                                                        \
   X(capath)                                                                    \
   X(cipher)                                                                    \
-  X(rejectUnauthorized)
+  X(rejectUnauthorized)                                                        \
+  X(sessionCache)
+#define CFG_OPTIONS_SOCKET                                                     \
+  X(profile)                                                                   \
+  X(noDelay)                                                                   \
+  X(recvBuffer)                                                                \
+  X(sendBuffer)                                                                \
+  X(quickAck)                                                                  \
+  X(busyPoll)
+#define TRACE_KINDS                                                            \
+  X(state)                                                                     \
+  X(poll)                                                                      \
+  X(wait)                                                                      \
+  X(pause)                                                                     \
+  X(resume)                                                                    \
+  X(error)                                                                     \
+  X(close)
+#define TRACE_FIELDS                                                           \
+  X(kind)                                                                      \
+  X(state)                                                                     \
+  X(value)                                                                     \
+  X(ago)
+#define MEM_KINDS                                                              \
+  X(result)                                                                    \
+  X(net)                                                                       \
+  X(context)                                                                   \
+  X(query)
 
 #ifdef _WIN32
 # define CHECK_CONNRESET (WSAGetLastError() == WSAECONNRESET   ||              \
@@ -173,15 +245,6 @@ using namespace v8;
 # define CHECK_CONNRESET (errno == ECONNRESET || errno == ENOTCONN)
 #endif
 
-Nan::Persistent<FunctionTemplate> constructor;
-//Nan::Persistent<FunctionTemplate> stmt_constructor;
-Nan::Persistent<String> code_symbol;
-Nan::Persistent<String> context_symbol;
-Nan::Persistent<String> conncfg_symbol;
-Nan::Persistent<String> neg_one_symbol;
-char u64_buf[21];
-char conn_check_buf[1];
-
 #define X(state, val)                                                          \
 const int STATE_##state = val;
 STATES
@@ -194,22 +257,102 @@ STATES
 #undef X
 };
 
-#define X(name)                                                                \
-Nan::Persistent<String> ev_##name##_symbol;
-EVENT_NAMES
+enum trace_kind {
+#define X(kind)                                                                \
+  TRACE_##kind,
+TRACE_KINDS
 #undef X
+};
 
-#define X(suffix, abbr, literal)                                               \
-Nan::Persistent<String> col_##abbr##_symbol;
-FIELD_TYPES
+const char* trace_kind_strings[] = {
+#define X(kind)                                                                \
+#kind,
+TRACE_KINDS
 #undef X
-Nan::Persistent<String> col_unsup_symbol;
+};
+
+struct trace_entry {
+  uint64_t time;
+  uint32_t value;
+  uint8_t kind;
+  uint8_t state;
+};
 
+// Per-isolate state. The addon is context-aware, so the main thread and every
+// worker thread that loads it get their own instance (see init()), which is
+// handed to bindings through their function template data.
+struct addon_data {
+  Nan::Persistent<FunctionTemplate> constructor;
+  Nan::Persistent<FunctionTemplate> group_constructor;
+  Nan::Persistent<Function> lazy_constructor;
+  //Nan::Persistent<FunctionTemplate> stmt_constructor;
+  Nan::Persistent<String> code_symbol;
+  Nan::Persistent<String> context_symbol;
+  Nan::Persistent<String> conncfg_symbol;
+  Nan::Persistent<String> group_symbol;
+  Nan::Persistent<String> neg_one_symbol;
 #define X(name)                                                                \
-Nan::Persistent<String> cfg_##name##_symbol;
-CFG_OPTIONS
-CFG_OPTIONS_SSL
+  Nan::Persistent<String> ev_##name##_symbol;
+  EVENT_NAMES
+#undef X
+#define X(field)                                                               \
+  Nan::Persistent<String> trace_##field##_symbol;
+  TRACE_FIELDS
+#undef X
+  Nan::Persistent<String> trace_symbol;
+#define X(suffix, abbr, literal)                                               \
+  Nan::Persistent<String> col_##abbr##_symbol;
+  FIELD_TYPES
+#undef X
+  Nan::Persistent<String> col_unsup_symbol;
+#define X(name)                                                                \
+  Nan::Persistent<String> cfg_##name##_symbol;
+  CFG_OPTIONS
+  CFG_OPTIONS_SSL
+  CFG_OPTIONS_SOCKET
+#undef X
+#define X(kind)                                                                \
+  Nan::Persistent<String> mem_##kind##_symbol;
+  MEM_KINDS
+#undef X
+  Nan::Persistent<String> mem_total_symbol;
+
+  ~addon_data() {
+    constructor.Reset();
+    group_constructor.Reset();
+    lazy_constructor.Reset();
+    code_symbol.Reset();
+    context_symbol.Reset();
+    conncfg_symbol.Reset();
+    group_symbol.Reset();
+    neg_one_symbol.Reset();
+#define X(name)                                                                \
+    ev_##name##_symbol.Reset();
+    EVENT_NAMES
+#undef X
+#define X(field)                                                               \
+    trace_##field##_symbol.Reset();
+    TRACE_FIELDS
 #undef X
+    trace_symbol.Reset();
+#define X(suffix, abbr, literal)                                               \
+    col_##abbr##_symbol.Reset();
+    FIELD_TYPES
+#undef X
+    col_unsup_symbol.Reset();
+#define X(name)                                                                \
+    cfg_##name##_symbol.Reset();
+    CFG_OPTIONS
+    CFG_OPTIONS_SSL
+    CFG_OPTIONS_SOCKET
+#undef X
+#define X(kind)                                                                \
+    mem_##kind##_symbol.Reset();
+    MEM_KINDS
+#undef X
+    mem_total_symbol.Reset();
+  }
+};
 
 struct sql_config {
   char* user;
@@ -224,6 +367,16 @@ struct sql_config {
   unsigned int tcpkaIntvl;
   bool metadata;
   char* charset;
+  unsigned long ext_threshold;
+  // seconds east of UTC of the session time zone, or TZ_LOCAL
+  long tz_offset;
+
+  // socket
+  bool sock_nodelay;
+  int sock_rcvbuf;
+  int sock_sndbuf;
+  bool sock_quickack;
+  int sock_busy_poll;
 
   // ssl
   char* ssl_key;
@@ -241,6 +394,685 @@ const int PROTOCOL_PIPE = MYSQL_PROTOCOL_PIPE;
 const int PROTOCOL_MEMORY = MYSQL_PROTOCOL_MEMORY;
 const int PROTOCOL_DEFAULT = MYSQL_PROTOCOL_DEFAULT;
 
+static size_t mem_root_size(const MEM_ROOT* root) {
+  size_t size = 0;
+  for (USED_MEM* block = root->free; block; block = block->next)
+    size += block->size;
+  for (USED_MEM* block = root->used; block; block = block->next)
+    size += block->size;
+  return size;
+}
+
+static size_t result_mem_size(const MYSQL_RES* res) {
+  size_t size = sizeof(MYSQL_RES) + mem_root_size(&res->field_alloc);
+  if (res->data)
+    size += sizeof(MYSQL_DATA) + mem_root_size(&res->data->alloc);
+  return size;
+}
+
+// The escape character to emit (after a backslash) for each byte that
+// mysql_escape_string() would escape, 0 otherwise
+static const char escape_chars[256] = {
+  '0', 0, 0, 0, 0, 0, 0, 0, 0, 0, 'n', 0, 0, 'r', 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 'Z', 0, 0, 0, 0, 0,
+  0, 0, '"', 0, 0, 0, 0, '\'', 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+};
+
+// Returns a pointer to the first byte in [p, end) that needs escaping, or
+// `end` if there is none
+static inline const char* find_escapable(const char* p, const char* end) {
+#if HAVE_SSE2
+  const __m128i nul_v = _mm_setzero_si128();
+  const __m128i nl_v = _mm_set1_epi8('\n');
+  const __m128i cr_v = _mm_set1_epi8('\r');
+  const __m128i ctrlz_v = _mm_set1_epi8('\032');
+  const __m128i dquote_v = _mm_set1_epi8('"');
+  const __m128i squote_v = _mm_set1_epi8('\'');
+  const __m128i bslash_v = _mm_set1_epi8('\\');
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i match = _mm_or_si128(
+      _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, nul_v), _mm_cmpeq_epi8(chunk, nl_v)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, cr_v),
+                     _mm_cmpeq_epi8(chunk, ctrlz_v))
+      ),
+      _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, dquote_v),
+                     _mm_cmpeq_epi8(chunk, squote_v)),
+        _mm_cmpeq_epi8(chunk, bslash_v)
+      )
+    );
+    int mask = _mm_movemask_epi8(match);
+    if (mask)
+      return p + ctz32(static_cast<unsigned int>(mask));
+    p += 16;
+  }
+#endif
+  for (; p < end; ++p) {
+    if (escape_chars[static_cast<unsigned char>(*p)])
+      return p;
+  }
+  return end;
+}
+
+static inline bool is_ascii(const char* p, size_t len) {
+  const char* end = p + len;
+#if HAVE_SSE2
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    if (_mm_movemask_epi8(chunk))
+      return false;
+    p += 16;
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p & 0x80)
+      return false;
+  }
+  return true;
+}
+
+// MySQL's latin1 is really cp1252, which only differs from ISO-8859-1 (the
+// encoding of one-byte V8 strings) in 0x80-0x9F. The few bytes cp1252 leaves
+// undefined are mapped to the C1 controls, like MySQL does.
+static const uint16_t cp1252_c1[32] = {
+  0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+  0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+  0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+  0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+// Whether latin1 text reads the same as ISO-8859-1 (no bytes in 0x80-0x9F)
+static inline bool is_iso8859_1(const char* p, size_t len) {
+  const char* end = p + len;
+#if HAVE_SSE2
+  const __m128i mask = _mm_set1_epi8(static_cast<char>(0xE0));
+  const __m128i c1 = _mm_set1_epi8(static_cast<char>(0x80));
+  while (end - p >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(chunk, mask), c1)))
+      return false;
+    p += 16;
+  }
+#endif
+  for (; p < end; ++p) {
+    if ((static_cast<unsigned char>(*p) & 0xE0) == 0x80)
+      return false;
+  }
+  return true;
+}
+
+// Decodes latin1 (cp1252) text containing bytes in 0x80-0x9F
+static Local<String> cp1252_string(const char* data, size_t len) {
+  uint16_t stack_buf[256];
+  uint16_t* buf = stack_buf;
+  if (len > 256) {
+    buf = static_cast<uint16_t*>(malloc(len * sizeof(uint16_t)));
+    if (!buf) {
+      return Nan::NewOneByteString(
+        reinterpret_cast<const uint8_t*>(data), static_cast<int>(len)
+      ).ToLocalChecked();
+    }
+  }
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = static_cast<unsigned char>(data[i]);
+    buf[i] = ((c & 0xE0) == 0x80 ? cp1252_c1[c - 0x80] : c);
+  }
+  Local<String> ret =
+    Nan::New<String>(buf, static_cast<int>(len)).ToLocalChecked();
+  if (buf != stack_buf)
+    free(buf);
+  return ret;
+}
+
+// Equivalent to mysql_escape_string() for ASCII-compatible charsets whose
+// multibyte sequences never contain ASCII bytes (e.g. utf8 and latin1), but
+// copies runs of bytes that do not need escaping in bulk. `dest` must have
+// room for `len * 2` bytes.
+static size_t escape_string(char* dest, const char* src, size_t len) {
+  const char* end = src + len;
+  char* out = dest;
+  while (src < end) {
+    const char* special = find_escapable(src, end);
+    size_t run = special - src;
+    memcpy(out, src, run);
+    out += run;
+    src = special;
+    if (src == end)
+      break;
+    *out++ = '\\';
+    *out++ = escape_chars[static_cast<unsigned char>(*src++)];
+  }
+  return out - dest;
+}
+
+// Conversions of numeric column values requested per query. Must be kept in
+// sync with the NUMBERS_* constants in lib/Client.js.
+#define NUMBERS_BIGINT_NUMBER  1
+#define NUMBERS_BIGINT_BIGINT  2
+#define NUMBERS_DECIMAL_BIGINT 4
+#define NUMBERS_DATES_NUMBER   8
+#define NUMBERS_DATES_BIGINT   16
+#define NUMBERS_DATES_DATE     32
+#define NUMBERS_DATES                                                          \
+  (NUMBERS_DATES_NUMBER | NUMBERS_DATES_BIGINT | NUMBERS_DATES_DATE)
+// Largest integer a double can represent exactly (2^53 - 1)
+#define MAX_SAFE_INTEGER 9007199254740991ULL
+// Enough 32-bit limbs for any DECIMAL (at most 65 digits) scaled to an
+// integer
+#define DECIMAL_LIMBS 8
+// calc_daynr(1970, 1, 1)
+#define DAYNR_EPOCH 719528L
+// Time zone offset meaning the client's local time zone
+#define TZ_LOCAL LONG_MIN
+
+// From sql-common/my_time.c, whose header cannot be included here as it pulls
+// in all of my_global.h
+extern "C" {
+  typedef struct st_mysql_time_status {
+    int warnings;
+    unsigned int precision;
+  } MYSQL_TIME_STATUS;
+  my_bool str_to_time(const char* str, unsigned int length, MYSQL_TIME* l_time,
+                      unsigned long long flags, MYSQL_TIME_STATUS* status);
+  my_bool str_to_datetime(const char* str, unsigned int length,
+                          MYSQL_TIME* l_time, unsigned long long flags,
+                          MYSQL_TIME_STATUS* status);
+  long calc_daynr(unsigned int year, unsigned int month, unsigned int day);
+}
+// Same as in my_time.h
+#define TIME_NO_ZERO_IN_DATE (1UL << 23)
+#define TIME_NO_ZERO_DATE    (1UL << 24)
+
+// Parses a time zone given as "Z", "+HH:MM", or "-HH:MM" into seconds east
+// of UTC. Anything else means the client's local time zone.
+static long parse_tz_offset(const char* tz) {
+  if (strcmp(tz, "Z") == 0)
+    return 0;
+  if ((tz[0] != '+' && tz[0] != '-')
+      || !isdigit(tz[1]) || !isdigit(tz[2])
+      || tz[3] != ':'
+      || !isdigit(tz[4]) || !isdigit(tz[5])
+      || tz[6] != '\0') {
+    return TZ_LOCAL;
+  }
+  long hours = (tz[1] - '0') * 10 + (tz[2] - '0');
+  long minutes = (tz[4] - '0') * 10 + (tz[5] - '0');
+  long offset = hours * 3600 + minutes * 60;
+  // Same range as RE_TIMEZONE in lib/Client.js
+  if (minutes > 59 || offset > (tz[0] == '-' ? 13 * 3600 + 59 * 60 : 14 * 3600))
+    return TZ_LOCAL;
+  return (tz[0] == '-' ? -offset : offset);
+}
+
+// Parses a run of decimal digits into `out`. Returns false on overflow or
+// any non-digit character.
+static inline bool parse_u64(const char* p, const char* end, uint64_t* out) {
+  uint64_t v = 0;
+  if (p == end)
+    return false;
+  for (; p < end; ++p) {
+    unsigned int d = static_cast<unsigned char>(*p) - '0';
+    if (d > 9 || v > (UINT64_MAX - d) / 10)
+      return false;
+    v = v * 10 + d;
+  }
+  *out = v;
+  return true;
+}
+
+// limbs = limbs * mul + add, with `*n` limbs (least significant first) in use
+static inline bool limbs_muladd(uint32_t* limbs,
+                                unsigned int* n,
+                                uint32_t mul,
+                                uint32_t add) {
+  uint64_t carry = add;
+  for (unsigned int i = 0; i < *n; ++i) {
+    uint64_t t = static_cast<uint64_t>(limbs[i]) * mul + carry;
+    limbs[i] = static_cast<uint32_t>(t);
+    carry = t >> 32;
+  }
+  if (carry) {
+    if (*n == DECIMAL_LIMBS)
+      return false;
+    limbs[(*n)++] = static_cast<uint32_t>(carry);
+  }
+  return true;
+}
+
+#if HAVE_BIGINT
+static inline Local<Value> make_bigint(bool negative,
+                                       int count,
+                                       const uint64_t* words) {
+  Local<BigInt> ret;
+  if (!BigInt::NewFromWords(Nan::GetCurrentContext(),
+                            (negative ? 1 : 0),
+                            count,
+                            words).ToLocal(&ret)) {
+    return Local<Value>();
+  }
+  return ret;
+}
+#endif
+
+// Converts an unsigned 64-bit count (e.g. the number of affected rows)
+// according to `numbers`
+static Local<Value> make_u64(uint64_t v, uint32_t numbers) {
+#if HAVE_BIGINT
+  if (numbers & NUMBERS_BIGINT_BIGINT)
+    return BigInt::NewFromUnsigned(v8::Isolate::GetCurrent(), v);
+#endif
+  if ((numbers & NUMBERS_BIGINT_NUMBER) && v <= MAX_SAFE_INTEGER)
+    return Nan::New<Number>(static_cast<double>(v));
+  char u64_buf[21];
+  int r = snprintf(u64_buf, sizeof(u64_buf), "%" PRIu64, v);
+  if (r <= 0 || r >= sizeof(u64_buf))
+    return Nan::EmptyString();
+  return Nan::New<String>(u64_buf, r).ToLocalChecked();
+}
+
+static inline bool wants_numeric(const MYSQL_FIELD& field, uint32_t numbers) {
+  switch (field.type) {
+    case MYSQL_TYPE_LONGLONG:
+      return (numbers & (NUMBERS_BIGINT_NUMBER | NUMBERS_BIGINT_BIGINT)) != 0;
+    case MYSQL_TYPE_NEWDECIMAL:
+    case MYSQL_TYPE_DECIMAL:
+      return (numbers & NUMBERS_DECIMAL_BIGINT) != 0;
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_NEWDATE:
+    case MYSQL_TYPE_TIME:
+      return (numbers & NUMBERS_DATES) != 0;
+    default:
+      return false;
+  }
+}
+
+// Converts a TIMESTAMP, DATETIME, or DATE column value to the point in time
+// it represents in the time zone given by `tz_offset`, or a TIME column value
+// to the duration it represents. Returns an empty handle if the value should
+// be passed on as a string instead (e.g. zero dates).
+static Local<Value> make_temporal(const MYSQL_FIELD& field,
+                                  const char* data,
+                                  unsigned long len,
+                                  uint32_t numbers,
+                                  long tz_offset) {
+  MYSQL_TIME t;
+  MYSQL_TIME_STATUS status;
+  int64_t us;
+
+  status.warnings = 0;
+  status.precision = 0;
+  if (field.type == MYSQL_TYPE_TIME) {
+    if (str_to_time(data, static_cast<unsigned int>(len), &t, 0, &status)
+        || t.time_type != MYSQL_TIMESTAMP_TIME) {
+      return Local<Value>();
+    }
+    us = ((static_cast<int64_t>(t.day) * 24 + t.hour) * 3600
+          + t.minute * 60
+          + t.second) * 1000000
+         + t.second_part;
+    if (t.neg)
+      us = -us;
+  } else {
+    if (str_to_datetime(data,
+                        static_cast<unsigned int>(len),
+                        &t,
+                        TIME_NO_ZERO_DATE | TIME_NO_ZERO_IN_DATE,
+                        &status)
+        || (t.time_type != MYSQL_TIMESTAMP_DATETIME
+            && t.time_type != MYSQL_TIMESTAMP_DATE)
+        || t.month == 0
+        || t.day == 0) {
+      return Local<Value>();
+    }
+    int64_t secs;
+    if (tz_offset == TZ_LOCAL) {
+      struct tm tm;
+      memset(&tm, 0, sizeof(tm));
+      tm.tm_year = static_cast<int>(t.year) - 1900;
+      tm.tm_mon = static_cast<int>(t.month) - 1;
+      tm.tm_mday = t.day;
+      tm.tm_hour = t.hour;
+      tm.tm_min = t.minute;
+      tm.tm_sec = t.second;
+      tm.tm_isdst = -1;
+      time_t ts = mktime(&tm);
+      if (ts == static_cast<time_t>(-1))
+        return Local<Value>();
+      secs = static_cast<int64_t>(ts);
+    } else {
+      secs = static_cast<int64_t>(calc_daynr(t.year, t.month, t.day)
+                                  - DAYNR_EPOCH) * 86400
+             + t.hour * 3600
+             + t.minute * 60
+             + t.second
+             - tz_offset;
+    }
+    us = secs * 1000000 + t.second_part;
+  }
+
+#if HAVE_BIGINT
+  if (numbers & NUMBERS_DATES_BIGINT)
+    return BigInt::New(v8::Isolate::GetCurrent(), us);
+#endif
+  double ms = static_cast<double>(us) / 1000;
+  if ((numbers & NUMBERS_DATES_DATE) && field.type != MYSQL_TYPE_TIME)
+    return Nan::New<Date>(ms).ToLocalChecked();
+  return Nan::New<Number>(ms);
+}
+
+// Converts a BIGINT, DECIMAL, or temporal column value according to
+// `numbers`. Returns an empty handle if the value should be passed on as a
+// string instead.
+static Local<Value> make_numeric(const MYSQL_FIELD& field,
+                                 const char* data,
+                                 unsigned long len,
+                                 uint32_t numbers,
+                                 long tz_offset) {
+  if (numbers & NUMBERS_DATES) {
+    switch (field.type) {
+      case MYSQL_TYPE_TIMESTAMP:
+      case MYSQL_TYPE_DATETIME:
+      case MYSQL_TYPE_DATE:
+      case MYSQL_TYPE_NEWDATE:
+      case MYSQL_TYPE_TIME:
+        return make_temporal(field, data, len, numbers, tz_offset);
+      default:
+        break;
+    }
+  }
+
+  const char* end = data + len;
+  bool negative = (len > 0 && *data == '-');
+  const char* p = data + negative;
+
+  if (field.type == MYSQL_TYPE_LONGLONG) {
+    uint64_t v;
+    if (!parse_u64(p, end, &v))
+      return Local<Value>();
+#if HAVE_BIGINT
+    if (numbers & NUMBERS_BIGINT_BIGINT)
+      return make_bigint(negative, 1, &v);
+#endif
+    if (v > MAX_SAFE_INTEGER)
+      return Local<Value>();
+    double d = static_cast<double>(v);
+    return Nan::New<Number>(negative ? -d : d);
+  }
+
+#if HAVE_BIGINT
+  // DECIMAL values are sent with exactly `decimals` fractional digits, which
+  // makes dropping the decimal point the same as scaling by 10^decimals
+  uint32_t limbs[DECIMAL_LIMBS];
+  unsigned int n = 0;
+  unsigned int frac = 0;
+  bool seen_point = false;
+  uint32_t chunk = 0;
+  uint32_t chunk_mul = 1;
+  if (p == end)
+    return Local<Value>();
+  for (; p < end; ++p) {
+    if (*p == '.' && !seen_point) {
+      seen_point = true;
+      continue;
+    }
+    unsigned int d = static_cast<unsigned char>(*p) - '0';
+    if (d > 9)
+      return Local<Value>();
+    chunk = chunk * 10 + d;
+    chunk_mul *= 10;
+    frac += seen_point;
+    // Digits are added nine at a time
+    if (chunk_mul == 1000000000) {
+      if (!limbs_muladd(limbs, &n, chunk_mul, chunk))
+        return Local<Value>();
+      chunk = 0;
+      chunk_mul = 1;
+    }
+  }
+  if (frac > field.decimals)
+    return Local<Value>();
+  for (; frac < field.decimals; ++frac) {
+    chunk = chunk * 10;
+    chunk_mul *= 10;
+    if (chunk_mul == 1000000000) {
+      if (!limbs_muladd(limbs, &n, chunk_mul, chunk))
+        return Local<Value>();
+      chunk = 0;
+      chunk_mul = 1;
+    }
+  }
+  if (chunk_mul > 1 && !limbs_muladd(limbs, &n, chunk_mul, chunk))
+    return Local<Value>();
+
+  uint64_t words[DECIMAL_LIMBS / 2];
+  int count = 0;
+  for (unsigned int i = 0; i < n; i += 2) {
+    words[count++] = (static_cast<uint64_t>(i + 1 < n ? limbs[i + 1] : 0) << 32)
+                     | limbs[i];
+  }
+  if (count == 0)
+    words[count++] = 0;
+  return make_bigint(negative, count, words);
+#else
+  return Local<Value>();
+#endif
+}
+
+// Nan::AdjustExternalMemory() only takes an int, so large changes (e.g. from
+// buffered results of 2GB or more) are reported in chunks
+static void adjust_external_memory(int64_t delta) {
+  while (delta > INT32_MAX) {
+    Nan::AdjustExternalMemory(INT32_MAX);
+    delta -= INT32_MAX;
+  }
+  while (delta < -INT32_MAX) {
+    Nan::AdjustExternalMemory(-INT32_MAX);
+    delta += INT32_MAX;
+  }
+  if (delta != 0)
+    Nan::AdjustExternalMemory(static_cast<int>(delta));
+}
+
+// A buffered result whose memory is still referenced by external strings
+// after the query that produced it has finished
+struct shared_result {
+  MYSQL_RES* res;
+  size_t size;
+  unsigned int refs;
+};
+
+static void unref_shared_result(shared_result* shared) {
+  if (--shared->refs == 0) {
+    // Buffered results do not reference the connection, so this is safe even
+    // after the connection has gone away
+    mysql_free_result(shared->res);
+    adjust_external_memory(-static_cast<int64_t>(shared->size));
+    delete shared;
+  }
+}
+
+// Backs a V8 string with a column value stored in a buffered result
+class ResultString : public Nan::ExternalOneByteStringResource {
+  public:
+    ResultString(shared_result* shared, const char* data, size_t length)
+      : shared_(shared), data_(data), length_(length) {
+      ++shared_->refs;
+    }
+
+    ~ResultString() {
+      unref_shared_result(shared_);
+    }
+
+    const char* data() const {
+      return data_;
+    }
+
+    size_t length() const {
+      return length_;
+    }
+
+  private:
+    shared_result* shared_;
+    const char* data_;
+    size_t length_;
+};
+
+// A buffered result whose column values are only converted to JS values when
+// they are accessed. Only the row pointers and column lengths are copied out
+// of the result up front.
+class LazyResult : public Nan::ObjectWrap {
+  public:
+    LazyResult() {
+      shared = nullptr;
+      fields = nullptr;
+      n_fields = 0;
+      n_rows = 0;
+      rows = nullptr;
+      lengths = nullptr;
+      one_byte = false;
+      ext_threshold = 0;
+      numbers = 0;
+      tz_offset = TZ_LOCAL;
+    }
+
+    ~LazyResult() {
+      DBG_LOG("~LazyResult()\n");
+      adjust_external_memory(-static_cast<int64_t>(index_size()));
+      FREE(rows);
+      FREE(lengths);
+      if (shared)
+        unref_shared_result(shared);
+    }
+
+    // Copies the row pointers and lengths out of `res` and takes a reference
+    // on `shared_res`, which must wrap `res`
+    bool fill(shared_result* shared_res, bool one_byte_res,
+              unsigned long threshold, uint32_t numbers_flags, long tz) {
+      MYSQL_RES* res = shared_res->res;
+      uint64_t nrows = mysql_num_rows(res);
+      if (nrows > INT32_MAX)
+        return false;
+      n_fields = mysql_num_fields(res);
+      n_rows = static_cast<uint32_t>(nrows);
+      fields = mysql_fetch_fields(res);
+      one_byte = one_byte_res;
+      ext_threshold = threshold;
+      numbers = numbers_flags;
+      tz_offset = tz;
+      if (n_rows > 0) {
+        rows = static_cast<MYSQL_ROW*>(malloc(sizeof(MYSQL_ROW) * n_rows));
+        lengths = static_cast<unsigned long*>(
+          malloc(sizeof(unsigned long) * n_rows * n_fields)
+        );
+        if (!rows || !lengths)
+          return false;
+        adjust_external_memory(static_cast<int64_t>(index_size()));
+        mysql_data_seek(res, 0);
+        for (uint32_t i = 0; i < n_rows; ++i) {
+          rows[i] = mysql_fetch_row(res);
+          memcpy(lengths + i * n_fields,
+                 mysql_fetch_lengths(res),
+                 sizeof(unsigned long) * n_fields);
+        }
+      }
+      shared = shared_res;
+      ++shared->refs;
+      return true;
+    }
+
+    size_t index_size() const {
+      if (!rows || !lengths)
+        return 0;
+      return (sizeof(MYSQL_ROW) + sizeof(unsigned long) * n_fields) * n_rows;
+    }
+
+    static NAN_METHOD(Cell) {
+      LazyResult* obj = Nan::ObjectWrap::Unwrap<LazyResult>(info.This());
+      uint32_t row = info[0]->Uint32Value();
+      uint32_t col = info[1]->Uint32Value();
+
+      if (row >= obj->n_rows || col >= obj->n_fields)
+        return info.GetReturnValue().SetUndefined();
+
+      const char* data = obj->rows[row][col];
+      unsigned long len = obj->lengths[row * obj->n_fields + col];
+      const MYSQL_FIELD& field = obj->fields[col];
+
+      if (data == nullptr)
+        return info.GetReturnValue().SetNull();
+      if (obj->numbers != 0 && wants_numeric(field, obj->numbers)) {
+        Local<Value> num = make_numeric(field,
+                                        data,
+                                        len,
+                                        obj->numbers,
+                                        obj->tz_offset);
+        if (!num.IsEmpty())
+          return info.GetReturnValue().Set(num);
+      }
+      if (IS_BINARY(field)
+          || (obj->one_byte ? is_iso8859_1(data, len) : is_ascii(data, len))) {
+        if (obj->ext_threshold > 0 && len >= obj->ext_threshold) {
+          return info.GetReturnValue().Set(Nan::New<String>(
+            new ResultString(obj->shared, data, len)
+          ).ToLocalChecked());
+        }
+        return info.GetReturnValue().Set(Nan::NewOneByteString(
+          reinterpret_cast<const uint8_t*>(data), static_cast<int>(len)
+        ).ToLocalChecked());
+      }
+      if (obj->one_byte)
+        return info.GetReturnValue().Set(cp1252_string(data, len));
+      info.GetReturnValue().Set(
+        Nan::New<String>(data, static_cast<int>(len)).ToLocalChecked()
+      );
+    }
+
+    // Native memory held by the result, shared with any other references to it
+    static NAN_METHOD(Size) {
+      LazyResult* obj = Nan::ObjectWrap::Unwrap<LazyResult>(info.This());
+      size_t size = obj->index_size();
+      if (obj->shared)
+        size += obj->shared->size;
+      info.GetReturnValue().Set(static_cast<double>(size));
+    }
+
+    static NAN_METHOD(New) {
+      LazyResult* obj = new LazyResult();
+      obj->Wrap(info.This());
+      info.GetReturnValue().Set(info.This());
+    }
+
+    static void Initialize(addon_data* addon) {
+      Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+
+      tpl->InstanceTemplate()->SetInternalFieldCount(1);
+      tpl->SetClassName(Nan::New<String>("LazyResult").ToLocalChecked());
+
+      Nan::SetPrototypeMethod(tpl, "cell", Cell);
+      Nan::SetPrototypeMethod(tpl, "size", Size);
+
+      addon->lazy_constructor.Reset(tpl->GetFunction());
+    }
+
+    shared_result* shared;
+    MYSQL_FIELD* fields;
+    unsigned int n_fields;
+    uint32_t n_rows;
+    MYSQL_ROW* rows;
+    unsigned long* lengths;
+    bool one_byte;
+    unsigned long ext_threshold;
+    uint32_t numbers;
+    long tz_offset;
+};
+
 // ripped from libuv
 #ifdef _WIN32
   int set_keepalive(SOCKET socket, int on, unsigned int delay) {
@@ -319,10 +1151,214 @@ const int PROTOCOL_DEFAULT = MYSQL_PROTOCOL_DEFAULT;
   }
 #endif
 
-class Client : public Nan::ObjectWrap {
+int set_sockopt_int(uv_os_sock_t sock, int level, int name, int value) {
+  return setsockopt(sock, level, name, (const char*)&value, sizeof(value));
+}
+void set_quickack(uv_os_sock_t sock) {
+#ifdef TCP_QUICKACK
+  set_sockopt_int(sock, IPPROTO_TCP, TCP_QUICKACK, 1);
+#endif
+}
+
+// socket profile presets, see the `socket.profile` connection option
+const int BUSY_POLL_OLTP = 50; // microseconds
+// no SO_RCVBUF for bulk: the options are applied once connected, which is too
+// late for the TCP window scale to account for a larger receive buffer, and
+// setting it at all disables the kernel's receive buffer autotuning
+const int SNDBUF_BULK = 1024 * 1024;
+
+// Maximum number of streamed rows a Client queues per group batch, see
+// Client::group_batch_full()
+const uint32_t GROUP_BATCH_ROWS = 1000;
+
+// A Client whose fetch loop stopped because its share of the group's current
+// batch is full. It is continued once the batch has been delivered.
+struct GroupWaiter {
+  GroupWaiter* next_waiter;
+  bool is_waiting;
+  virtual void on_batch_flushed() = 0;
+};
+
+// Queues the callbacks of all Clients created with it and delivers them to JS
+// in a single call per event loop iteration, from a check handle (i.e. after
+// all sockets that were ready in the poll phase have been serviced). The batch
+// is a flat array of [callback, context, argc, arg0, ..., argN] entries.
+class ClientGroup : public Nan::ObjectWrap {
   public:
+    uv_loop_t* loop;
+    uv_check_t* check_handle;
+    // keeps the loop from blocking in the poll phase while a batch is pending
+    uv_idle_t* idle_handle;
+    Nan::Callback* ondispatch;
+    Nan::Persistent<Array> batch;
+    uint32_t batch_len;
+    // incremented for every batch, so clients can tell when to reset their
+    // per-batch row counts
+    uint32_t generation;
+    GroupWaiter* waiters;
+    bool scheduled;
+
+    ClientGroup(uv_loop_t* loop_, Local<Function> cb) {
+      DBG_LOG("ClientGroup()\n");
+      loop = loop_;
+      ondispatch = new Nan::Callback(cb);
+      batch.Reset(Nan::New<Array>());
+      batch_len = 0;
+      generation = 0;
+      waiters = nullptr;
+      scheduled = false;
+
+      check_handle = (uv_check_t*)malloc(sizeof(uv_check_t));
+      uv_check_init(loop, check_handle);
+      check_handle->data = this;
+
+      idle_handle = (uv_idle_t*)malloc(sizeof(uv_idle_t));
+      uv_idle_init(loop, idle_handle);
+      idle_handle->data = this;
+    }
+
+    ~ClientGroup() {
+      DBG_LOG("~ClientGroup()\n");
+      uv_close((uv_handle_t*)check_handle, cb_free_handle);
+      uv_close((uv_handle_t*)idle_handle, cb_free_handle);
+      delete ondispatch;
+      batch.Reset();
+    }
+
+    void push(Nan::Callback* cb,
+              Local<Object> context,
+              int argc,
+              Local<Value> argv[]) {
+      Nan::HandleScope scope;
+
+      Local<Array> entries = Nan::New<Array>(batch);
+      entries->Set(batch_len++, cb->GetFunction());
+      entries->Set(batch_len++, context);
+      entries->Set(batch_len++, Nan::New<Integer>(argc));
+      for (int i = 0; i < argc; ++i)
+        entries->Set(batch_len++, argv[i]);
+
+      if (!scheduled) {
+        scheduled = true;
+        uv_check_start(check_handle, cb_check);
+        uv_idle_start(idle_handle, cb_idle);
+      }
+    }
+
+    void add_waiter(GroupWaiter* w) {
+      if (w->is_waiting)
+        return;
+      w->is_waiting = true;
+      w->next_waiter = waiters;
+      waiters = w;
+    }
+
+    void remove_waiter(GroupWaiter* w) {
+      if (!w->is_waiting)
+        return;
+      for (GroupWaiter** p = &waiters; *p; p = &(*p)->next_waiter) {
+        if (*p == w) {
+          *p = w->next_waiter;
+          break;
+        }
+      }
+      w->is_waiting = false;
+    }
+
+    void flush() {
+      Nan::HandleScope scope;
+
+      DBG_LOG("ClientGroup::flush() batch_len=%u\n", batch_len);
+
+      uv_check_stop(check_handle);
+      uv_idle_stop(idle_handle);
+      scheduled = false;
+
+      // Callbacks pushed while dispatching go into a fresh batch
+      Local<Value> argv[1] = { Nan::New<Array>(batch) };
+      batch.Reset(Nan::New<Array>());
+      batch_len = 0;
+      ++generation;
+
+      ondispatch->Call(1, argv);
+
+      // Waiters only queue callbacks (they are part of this group), so none
+      // of them can go away while the list is walked
+      GroupWaiter* w = waiters;
+      waiters = nullptr;
+      while (w) {
+        GroupWaiter* next = w->next_waiter;
+        w->is_waiting = false;
+        w->on_batch_flushed();
+        w = next;
+      }
+    }
+
+    static void cb_free_handle(uv_handle_t* handle) {
+      free(handle);
+    }
+
+#if UV_VERSION_MAJOR == 0
+    static void cb_check(uv_check_t* handle, int status) {
+#else
+    static void cb_check(uv_check_t* handle) {
+#endif
+      ((ClientGroup*)handle->data)->flush();
+    }
+
+#if UV_VERSION_MAJOR == 0
+    static void cb_idle(uv_idle_t* handle, int status) {}
+#else
+    static void cb_idle(uv_idle_t* handle) {}
+#endif
+
+    static NAN_METHOD(New) {
+      DBG_LOG("new ClientGroupBinding()\n");
+
+      if (!info.IsConstructCall()) {
+        return Nan::ThrowTypeError(
+          "Use `new` to create instances of this object."
+        );
+      }
+      if (info.Length() == 0 || !info[0]->IsFunction())
+        return Nan::ThrowTypeError("Missing dispatch function");
+
+      ClientGroup* obj = new ClientGroup(Nan::GetCurrentEventLoop(),
+                                         Local<Function>::Cast(info[0]));
+      obj->Wrap(info.This());
+
+      info.GetReturnValue().Set(info.This());
+    }
+
+    static void Initialize(Handle<Object> target, addon_data* addon) {
+      Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+      Local<String> name =
+        Nan::New<String>("ClientGroupBinding").ToLocalChecked();
+
+      addon->group_constructor.Reset(tpl);
+      tpl->InstanceTemplate()->SetInternalFieldCount(1);
+      tpl->SetClassName(name);
+
+      target->Set(name, tpl->GetFunction());
+    }
+};
+
+class Client : public Nan::ObjectWrap, public GroupWaiter {
+  public:
+    addon_data* addon;
+    // set if callbacks are delivered in batches, see ClientGroup
+    ClientGroup* group;
+    Nan::Persistent<Object> group_ref;
+    // streamed rows queued in the group's current batch
+    uint32_t batch_rows;
+    uint32_t batch_generation;
+    bool batch_full;
+    // loop of the thread that created this instance
+    uv_loop_t* loop;
     Nan::Persistent<Object> context;
     uv_poll_t* poll_handle;
+    // deadline for the current query, see query()
+    uv_timer_t* timer_handle;
     uv_os_sock_t mysql_sock;
     MYSQL mysql;
     MYSQL* mysql_ret;
@@ -332,29 +1368,80 @@ class Client : public Nan::ObjectWrap {
     bool is_destructing;
     bool is_paused;
     bool is_buffering;
-    Nan::Utf8String* cur_query;
+    // the query currently being sent, either pointing into `query_buf` or
+    // into a Buffer passed in from JS (kept alive by `query_ref`)
+    const char* query_data;
+    unsigned long query_len;
+    char* query_buf;
+    size_t query_buf_size;
+    Nan::Persistent<Object> query_ref;
     MYSQL_RES* cur_result;
+    shared_result* cur_shared;
     //MYSQL_STMT* cur_stmt;
     MYSQL_ROW cur_row;
     bool req_columns;
     bool need_columns;
     bool req_metadata;
     bool need_metadata;
+    bool req_lazy;
+    // NUMBERS_* flags for the current query
+    uint32_t req_numbers;
+    bool one_byte_results;
+    // private copies of the arguments for the current change user/select db
+    // operation (libmariadbclient frees the previous user/password/db on
+    // success, so they cannot point into the MYSQL struct)
+    char* cu_user;
+    char* cu_password;
+    char* cu_db;
     int state;
     int last_status;
     unsigned long threadId;
+#define X(kind)                                                                \
+    size_t mem_##kind;
+    MEM_KINDS
+#undef X
+    int64_t mem_reported;
+    trace_entry trace_buf[TRACE_SIZE];
+    unsigned int trace_pos;
+    int traced_state;
 #define X(name)                                                                \
     Nan::Callback* on##name;
     EVENT_NAMES
 #undef X
 
-    Client() {
+    Client(addon_data* addon_, uv_loop_t* loop_) {
       DBG_LOG("Client()\n");
+      addon = addon_;
+      loop = loop_;
+      group = nullptr;
+      batch_rows = 0;
+      batch_generation = 0;
+      batch_full = false;
+      next_waiter = nullptr;
+      is_waiting = false;
       state = STATE_CLOSED;
 
       is_destructing = false;
       initialized = false;
+      timer_handle = nullptr;
       threadId = 0;
+      query_data = nullptr;
+      query_len = 0;
+      query_buf = nullptr;
+      query_buf_size = 0;
+      cur_result = nullptr;
+      cur_shared = nullptr;
+      cu_user = nullptr;
+      cu_password = nullptr;
+      cu_db = nullptr;
+
+#define X(kind)                                                                \
+      mem_##kind = 0;
+      MEM_KINDS
+#undef X
+      mem_reported = 0;
+      trace_pos = 0;
+      traced_state = -1;
 
 #define X(name)                                                                \
       on##name = nullptr;
@@ -371,8 +1458,14 @@ class Client : public Nan::ObjectWrap {
 #undef X
       if (!context.IsEmpty())
         context.Reset();
+      if (group)
+        group->remove_waiter(this);
+      if (!group_ref.IsEmpty())
+        group_ref.Reset();
       is_destructing = true;
       close();
+      if (timer_handle)
+        uv_close((uv_handle_t*)timer_handle, cb_free_handle);
     }
 
     bool init() {
@@ -384,7 +1477,8 @@ class Client : public Nan::ObjectWrap {
       mysql_sock = 0;
 
       mysql_init(&mysql);
-      if (mysql_options(&mysql, MYSQL_OPT_NONBLOCK, 0) != 0)
+      size_t stack_size = ASYNC_STACK_SIZE;
+      if (mysql_options(&mysql, MYSQL_OPT_NONBLOCK, &stack_size) != 0)
         return false;
 
       config.user = nullptr;
@@ -397,8 +1491,15 @@ class Client : public Nan::ObjectWrap {
       config.tcpka = 0; // disabled by default
       config.tcpkaCnt = 0; // use system default
       config.tcpkaIntvl = 0; // use system default
+      config.sock_nodelay = true;
+      config.sock_rcvbuf = 0; // use system default
+      config.sock_sndbuf = 0; // use system default
+      config.sock_quickack = false;
+      config.sock_busy_poll = 0; // disabled by default
       config.metadata = false;
       config.charset = nullptr;
+      config.ext_threshold = 0;
+      config.tz_offset = TZ_LOCAL;
       config.ssl_key = nullptr;
       config.ssl_cert = nullptr;
       config.ssl_ca = nullptr;
@@ -408,11 +1509,15 @@ class Client : public Nan::ObjectWrap {
       is_cont = false;
 
       is_paused = false;
+      req_numbers = 0;
+      one_byte_results = false;
 
-      cur_query = nullptr;
+      cur_result = nullptr;
 
       initialized = true;
 
+      update_mem_usage();
+
       return true;
     }
 
@@ -429,10 +1534,75 @@ class Client : public Nan::ObjectWrap {
       FREE(config.ssl_capath);
       FREE(config.ssl_cipher);
       FREE(config.charset);
+      FREE(cu_user);
+      FREE(cu_password);
+      FREE(cu_db);
+
+      release_query(true);
+    }
+
+    // Makes `qry` (a Buffer or string) the current query. Strings are written
+    // into a send buffer that is reused across queries, skipping UTF-8
+    // transcoding entirely when the string is pure ASCII.
+    void set_query(Local<Value> qry) {
+      release_query();
+
+      if (Buffer::HasInstance(qry)) {
+        Local<Object> buf = qry->ToObject();
+        query_ref.Reset(buf);
+        query_data = Buffer::Data(buf);
+        query_len = static_cast<unsigned long>(Buffer::Length(buf));
+        return;
+      }
+
+      Local<String> str = qry->ToString();
+      size_t len = str->Length();
+#if NODE_MODULE_VERSION > NODE_0_10_MODULE_VERSION
+      if (str->IsOneByte()) {
+        reserve_query_buf(len);
+        str->WriteOneByte(reinterpret_cast<uint8_t*>(query_buf),
+                          0,
+                          static_cast<int>(len),
+                          String::NO_NULL_TERMINATION);
+        size_t i = 0;
+        while (i < len && !(query_buf[i] & 0x80))
+          ++i;
+        if (i == len) {
+          query_data = query_buf;
+          query_len = static_cast<unsigned long>(len);
+          return;
+        }
+        // Latin-1 characters need to be UTF-8 encoded
+      }
+#endif
+      len = str->Utf8Length();
+      reserve_query_buf(len);
+      str->WriteUtf8(query_buf,
+                     static_cast<int>(len),
+                     nullptr,
+                     String::NO_NULL_TERMINATION);
+      query_data = query_buf;
+      query_len = static_cast<unsigned long>(len);
+    }
 
-      if (cur_query) {
-        delete cur_query;
-        cur_query = nullptr;
+    void reserve_query_buf(size_t len) {
+      if (len + 1 > query_buf_size) {
+        FREE(query_buf);
+        query_buf = (char*)malloc(len + 1);
+        query_buf_size = (query_buf ? len + 1 : 0);
+      }
+    }
+
+    // Drops the reference to the current query, keeping the send buffer
+    // around for the next query unless it is unusually large
+    void release_query(bool free_buf = false) {
+      if (!query_ref.IsEmpty())
+        query_ref.Reset();
+      query_data = nullptr;
+      query_len = 0;
+      if (free_buf || query_buf_size > QUERY_BUF_KEEP) {
+        FREE(query_buf);
+        query_buf_size = 0;
       }
     }
 
@@ -446,6 +1616,10 @@ class Client : public Nan::ObjectWrap {
 
       clear_state();
 
+      trace(TRACE_close, is_dead);
+
+      stop_timer();
+
       if (state != STATE_CLOSED || is_dead) {
         state = STATE_CLOSED;
         Unref();
@@ -458,8 +1632,12 @@ class Client : public Nan::ObjectWrap {
             uv_close((uv_handle_t*)poll_handle, cb_close);
         }
         mysql_close(&mysql);
+        release_shared_result();
+        cur_result = nullptr;
+        update_mem_usage();
         return true;
       }
+      update_mem_usage();
       return false;
     }
 
@@ -474,18 +1652,68 @@ class Client : public Nan::ObjectWrap {
       return false;
     }
 
-    bool query(Local<Value> qry, bool columns, bool metadata, bool buffer) {
+    // Arms the deadline timer for the current query. When it expires before
+    // the query has finished, `ontimeout` is called.
+    void start_timer(uint32_t timeout) {
+      if (!timer_handle) {
+        timer_handle = (uv_timer_t*)malloc(sizeof(uv_timer_t));
+        uv_timer_init(loop, timer_handle);
+        timer_handle->data = this;
+      }
+      uv_timer_start(timer_handle, cb_timeout, timeout, 0);
+    }
+
+    void stop_timer() {
+      if (timer_handle)
+        uv_timer_stop(timer_handle);
+    }
+
+    // Errors are ignored, e.g. the TCP-level options do not apply to unix
+    // sockets and SO_BUSY_POLL may require privileges
+    void apply_socket_opts() {
+      if (config.sock_nodelay)
+        set_sockopt_int(mysql_sock, IPPROTO_TCP, TCP_NODELAY, 1);
+      if (config.sock_rcvbuf > 0)
+        set_sockopt_int(mysql_sock, SOL_SOCKET, SO_RCVBUF, config.sock_rcvbuf);
+      if (config.sock_sndbuf > 0)
+        set_sockopt_int(mysql_sock, SOL_SOCKET, SO_SNDBUF, config.sock_sndbuf);
+      if (config.sock_quickack)
+        set_quickack(mysql_sock);
+#ifdef SO_BUSY_POLL
+      if (config.sock_busy_poll > 0) {
+        set_sockopt_int(mysql_sock,
+                        SOL_SOCKET,
+                        SO_BUSY_POLL,
+                        config.sock_busy_poll);
+      }
+#endif
+    }
+
+    bool query(Local<Value> qry,
+               bool columns,
+               bool metadata,
+               bool buffer,
+               bool lazy,
+               uint32_t timeout,
+               uint32_t numbers) {
       DBG_LOG("[%lu] query() state=%s,columns=%d,metadata=%d,buffer=%d,"
-              "query=%s\n",
-              threadId, state_strings[state], columns, metadata, buffer, qry);
+              "lazy=%d,timeout=%u,numbers=%u\n",
+              threadId, state_strings[state], columns, metadata, buffer, lazy,
+              timeout, numbers);
       if (state == STATE_IDLE) {
-        if (cur_query)
-          delete cur_query;
-        cur_query = new Nan::Utf8String(qry);
+        if (timeout > 0)
+          start_timer(timeout);
+        // Linux clears quick ack mode on its own, so re-arm it for the reply
+        if (config.sock_quickack)
+          set_quickack(mysql_sock);
+        set_query(qry);
         req_columns = columns;
         req_metadata = metadata;
+        req_lazy = (buffer && lazy);
+        req_numbers = numbers;
         is_buffering = buffer;
         state = STATE_QUERY;
+        update_mem_usage();
         do_work();
         return true;
       }
@@ -525,6 +1753,7 @@ class Client : public Nan::ObjectWrap {
               threadId, state_strings[state], is_paused);
       if (state >= STATE_IDLE && !is_paused) {
         is_paused = true;
+        trace(TRACE_pause, 0);
         return true;
       }
       return false;
@@ -535,7 +1764,9 @@ class Client : public Nan::ObjectWrap {
               threadId, state_strings[state], is_paused);
       if (state == STATE_ROW && is_paused) {
         is_paused = false;
-        do_work(last_status);
+        trace(TRACE_resume, 0);
+        if (!batch_full)
+          do_work(last_status);
         return true;
       }
       return false;
@@ -551,6 +1782,44 @@ class Client : public Nan::ObjectWrap {
       return false;
     }
 
+    // Re-authenticates the current connection, resetting all session state.
+    // Any of the arguments can be null to use the current value.
+    bool change_user(const char* user, const char* password, const char* db) {
+      DBG_LOG("[%lu] change_user() state=%s\n",
+              threadId, state_strings[state]);
+      if (state == STATE_IDLE) {
+        FREE(cu_user);
+        FREE(cu_password);
+        FREE(cu_db);
+        if (!user)
+          user = mysql.user;
+        if (!password)
+          password = mysql.passwd;
+        if (!db)
+          db = mysql.db;
+        cu_user = (user ? strdup(user) : nullptr);
+        cu_password = (password ? strdup(password) : nullptr);
+        cu_db = (db ? strdup(db) : nullptr);
+        state = STATE_CHANGEUSER;
+        do_work();
+        return true;
+      }
+      return false;
+    }
+
+    bool select_db(const char* db) {
+      DBG_LOG("[%lu] select_db() state=%s,db=%s\n",
+              threadId, state_strings[state], db);
+      if (state == STATE_IDLE) {
+        FREE(cu_db);
+        cu_db = strdup(db);
+        state = STATE_SELECTDB;
+        do_work();
+        return true;
+      }
+      return false;
+    }
+
     uint64_t lastInsertId() {
       DBG_LOG("[%lu] lastInsertId() state=%s\n",
               threadId, state_strings[state]);
@@ -559,9 +1828,154 @@ class Client : public Nan::ObjectWrap {
     }
 
     unsigned long escape(const char* src, unsigned long src_len, char* dest) {
+      if (can_fast_escape())
+        return static_cast<unsigned long>(escape_string(dest, src, src_len));
       return mysql_real_escape_string(&mysql, dest, src, src_len);
     }
 
+    // Whether text results on this connection map one byte to one character
+    bool is_one_byte_charset() {
+      return (strcmp(mysql_character_set_name(&mysql), "latin1") == 0);
+    }
+
+    // Creates the JS value for a single column value. Binary values, latin1
+    // values without cp1252-specific characters, and pure ASCII values (the
+    // common case) map directly to one-byte strings, avoiding UTF-8
+    // decoding. Large one-byte values from buffered results can instead point
+    // directly into the result's memory if `external` is set.
+    inline Local<Value> make_cell(const MYSQL_FIELD& field,
+                                  const char* data,
+                                  unsigned long len,
+                                  bool external = false) {
+      if (data == nullptr)
+        return Nan::Null();
+      if (req_numbers != 0 && wants_numeric(field, req_numbers)) {
+        Local<Value> num = make_numeric(field,
+                                        data,
+                                        len,
+                                        req_numbers,
+                                        config.tz_offset);
+        if (!num.IsEmpty())
+          return num;
+      }
+      if (IS_BINARY(field)
+          || (one_byte_results
+              ? is_iso8859_1(data, len)
+              : is_ascii(data, len))) {
+        if (external
+            && config.ext_threshold > 0
+            && len >= config.ext_threshold) {
+          if (!cur_shared) {
+            cur_shared = new shared_result;
+            cur_shared->res = cur_result;
+            cur_shared->size = result_mem_size(cur_result);
+            cur_shared->refs = 1;
+          }
+          return Nan::New<String>(
+            new ResultString(cur_shared, data, len)
+          ).ToLocalChecked();
+        }
+        return Nan::NewOneByteString(
+          reinterpret_cast<const uint8_t*>(data), static_cast<int>(len)
+        ).ToLocalChecked();
+      }
+      if (one_byte_results)
+        return cp1252_string(data, len);
+      return Nan::New<String>(data, static_cast<int>(len)).ToLocalChecked();
+    }
+
+    // Hands ownership of the current result over to the external strings
+    // that reference it, if any. Returns true if that happened.
+    bool release_shared_result() {
+      if (!cur_shared)
+        return false;
+      // The result's memory is no longer ours to report, so it is reported
+      // separately until the last string referencing it is collected
+      adjust_external_memory(static_cast<int64_t>(cur_shared->size));
+      unref_shared_result(cur_shared);
+      cur_shared = nullptr;
+      return true;
+    }
+
+    // Whether escape_string() produces the same result as
+    // mysql_real_escape_string() for this connection
+    bool can_fast_escape() {
+      if (mysql.server_status & SERVER_STATUS_NO_BACKSLASH_ESCAPES)
+        return false;
+      const char* csname = mysql_character_set_name(&mysql);
+      return (strncmp(csname, "utf8", 4) == 0
+              || strcmp(csname, "latin1") == 0
+              || strcmp(csname, "ascii") == 0
+              || strcmp(csname, "binary") == 0);
+    }
+
+    // Records an entry in the connection's trace ring buffer. This is cheap
+    // enough to always be enabled and provides a history of recent activity
+    // when diagnosing errors or stalls.
+    inline void trace(trace_kind kind, uint32_t value) {
+      trace_entry& entry = trace_buf[trace_pos++ & (TRACE_SIZE - 1)];
+      entry.time = uv_hrtime();
+      entry.value = value;
+      entry.kind = static_cast<uint8_t>(kind);
+      entry.state = static_cast<uint8_t>(state);
+    }
+
+    // Returns the trace entries (oldest first) as an array of objects
+    Local<Array> trace_to_array() {
+      Nan::EscapableHandleScope scope;
+
+      unsigned int count = (trace_pos < TRACE_SIZE ? trace_pos : TRACE_SIZE);
+      unsigned int start = trace_pos - count;
+      uint64_t now = uv_hrtime();
+      Local<Array> entries = Nan::New<Array>(count);
+
+      for (unsigned int i = 0; i < count; ++i) {
+        const trace_entry& entry = trace_buf[(start + i) & (TRACE_SIZE - 1)];
+        Local<Object> obj = Nan::New<Object>();
+        obj->Set(Nan::New<String>(addon->trace_kind_symbol),
+                 Nan::New<String>(
+                   trace_kind_strings[entry.kind]
+                 ).ToLocalChecked());
+        obj->Set(Nan::New<String>(addon->trace_state_symbol),
+                 Nan::New<String>(state_strings[entry.state]).ToLocalChecked());
+        obj->Set(Nan::New<String>(addon->trace_value_symbol),
+                 Nan::New<Number>(entry.value));
+        // Microseconds elapsed since the entry was recorded
+        obj->Set(Nan::New<String>(addon->trace_ago_symbol),
+                 Nan::New<Number>(static_cast<double>(now - entry.time) / 1e3));
+        entries->Set(i, obj);
+      }
+
+      return scope.Escape(entries);
+    }
+
+    // Recalculates the amount of native memory held on behalf of this
+    // connection and lets V8 know about any change so that GC pressure
+    // reflects buffered results and other allocations V8 cannot see
+    void update_mem_usage() {
+      if (initialized) {
+        mem_net = (mysql.net.buff
+                   ? mysql.net.max_packet + NET_HEADER_SIZE
+                     + COMP_HEADER_SIZE + 1
+                   : 0);
+        mem_context = ASYNC_STACK_SIZE;
+      } else {
+        mem_net = 0;
+        mem_context = 0;
+      }
+      mem_query = query_buf_size;
+      mem_result = (cur_result ? result_mem_size(cur_result) : 0);
+
+      int64_t total = 0;
+#define X(kind)                                                                \
+      total += mem_##kind;
+      MEM_KINDS
+#undef X
+      int64_t delta = total - mem_reported;
+      mem_reported = total;
+      adjust_external_memory(delta);
+    }
+
     void do_work(int event = 0) {
       DBG_LOG("[%lu] do_work() state=%s,event=%s\n",
               threadId,
@@ -578,10 +1992,13 @@ class Client : public Nan::ObjectWrap {
       int err;
       bool done = false;
 
+      trace(TRACE_poll, event);
+
       if (state == STATE_CLOSED)
         return;
       else if (state == STATE_IDLE && event) {
         // Check for closed socket since we don't expect events if we are idle
+        char conn_check_buf[1];
         int r = recv(mysql_sock, conn_check_buf, 1, MSG_PEEK);
         if (r == 0 || (r == -1 && CHECK_CONNRESET)) {
           on_error(true, 2006, "MySQL server has gone away");
@@ -592,6 +2009,10 @@ class Client : public Nan::ObjectWrap {
       while (!done) {
         DBG_LOG("[%lu] do_work() loop begin, state=%s,is_cont=%d\n",
                 threadId, state_strings[state], is_cont);
+        if (state != traced_state) {
+          traced_state = state;
+          trace(TRACE_state, 0);
+        }
         switch (state) {
           case STATE_CONNECT:
             if (!is_cont) {
@@ -616,10 +2037,11 @@ class Client : public Nan::ObjectWrap {
                 if (config.tcpkaIntvl > 0)
                   set_keepalive_intvl(mysql_sock, config.tcpkaIntvl);
               }
+              apply_socket_opts();
 
               if (!poll_handle)
                 poll_handle = (uv_poll_t*)malloc(sizeof(uv_poll_t));
-              uv_poll_init_socket(uv_default_loop(), poll_handle, mysql_sock);
+              uv_poll_init_socket(loop, poll_handle, mysql_sock);
               uv_poll_start(poll_handle, UV_READABLE, cb_poll);
               poll_handle->data = this;
 
@@ -629,6 +2051,7 @@ class Client : public Nan::ObjectWrap {
               } else {
                 state = STATE_IDLE;
                 threadId = mysql_thread_id(&mysql);
+                update_mem_usage();
                 on_connect();
                 return;
               }
@@ -645,6 +2068,7 @@ class Client : public Nan::ObjectWrap {
                 }
                 state = STATE_IDLE;
                 threadId = mysql_thread_id(&mysql);
+                update_mem_usage();
                 on_connect();
                 return;
               }
@@ -654,18 +2078,14 @@ class Client : public Nan::ObjectWrap {
             if (!is_cont) {
               status = mysql_real_query_start(&err,
                                               &mysql,
-                                              **cur_query,
-                                              static_cast<unsigned long>(
-                                                cur_query->length()
-                                              ));
+                                              query_data,
+                                              query_len);
               if (status) {
                 done = true;
                 is_cont = true;
               } else {
-                if (cur_query) {
-                  delete cur_query;
-                  cur_query = nullptr;
-                }
+                release_query();
+                update_mem_usage();
                 if (err) {
                   state = STATE_IDLE;
                   on_error();
@@ -684,10 +2104,8 @@ class Client : public Nan::ObjectWrap {
                 done = true;
               else {
                 is_cont = false;
-                if (cur_query) {
-                  delete cur_query;
-                  cur_query = nullptr;
-                }
+                release_query();
+                update_mem_usage();
                 if (err) {
                   state = STATE_IDLE;
                   on_error();
@@ -710,6 +2128,7 @@ class Client : public Nan::ObjectWrap {
             is_paused = false;
 
             cur_result = mysql_use_result(&mysql);
+            update_mem_usage();
             if (!cur_result) {
               if (mysql_errno(&mysql))
                 on_error();
@@ -729,6 +2148,7 @@ class Client : public Nan::ObjectWrap {
             } else {
               need_columns = req_columns;
               need_metadata = req_metadata;
+              one_byte_results = is_one_byte_charset();
               state = STATE_ROW;
             }
           break;
@@ -745,7 +2165,7 @@ class Client : public Nan::ObjectWrap {
                 } else {
                   if (cur_row) {
                     on_row();
-                    if (is_paused)
+                    if (is_paused || group_batch_full())
                       done = true;
                   } else {
                     // no more rows
@@ -766,7 +2186,7 @@ class Client : public Nan::ObjectWrap {
                 } else {
                   if (cur_row) {
                     on_row();
-                    if (is_paused)
+                    if (is_paused || group_batch_full())
                       done = true;
                   } else {
                     // no more rows
@@ -826,12 +2246,16 @@ class Client : public Nan::ObjectWrap {
           break;
           case STATE_FREERESULT:
             if (!is_cont) {
-              status = mysql_free_result_start(cur_result);
+              if (release_shared_result())
+                status = 0;
+              else
+                status = mysql_free_result_start(cur_result);
               if (status) {
                 done = true;
                 is_cont = true;
               } else {
                 cur_result = nullptr;
+                update_mem_usage();
                 if (mysql_more_results(&mysql))
                   state = STATE_NEXTRESULT;
                 else {
@@ -847,6 +2271,7 @@ class Client : public Nan::ObjectWrap {
               else {
                 cur_result = nullptr;
                 is_cont = false;
+                update_mem_usage();
                 if (mysql_more_results(&mysql))
                   state = STATE_NEXTRESULT;
                 else {
@@ -861,15 +2286,20 @@ class Client : public Nan::ObjectWrap {
             if (!is_cont) {
               need_columns = req_columns;
               need_metadata = req_metadata;
+              one_byte_results = is_one_byte_charset();
               status = mysql_store_result_start(&cur_result, &mysql);
               if (status) {
                 done = true;
                 is_cont = true;
               } else {
+                update_mem_usage();
                 if (mysql_errno(&mysql))
                   on_error();
                 else {
-                  on_rows();
+                  if (req_lazy)
+                    on_lazy_rows();
+                  else
+                    on_rows();
                   on_resultend();
                 }
                 state = STATE_FREERESULT;
@@ -880,10 +2310,14 @@ class Client : public Nan::ObjectWrap {
                 done = true;
               else {
                 is_cont = false;
+                update_mem_usage();
                 if (mysql_errno(&mysql))
                   on_error();
                 else {
-                  on_rows();
+                  if (req_lazy)
+                    on_lazy_rows();
+                  else
+                    on_rows();
                   on_resultend();
                 }
                 state = STATE_FREERESULT;
@@ -921,6 +2355,59 @@ class Client : public Nan::ObjectWrap {
               }
             }
           break;
+          case STATE_CHANGEUSER:
+            if (!is_cont) {
+              my_bool cu_err;
+              status = mysql_change_user_start(&cu_err,
+                                               &mysql,
+                                               cu_user,
+                                               cu_password,
+                                               cu_db);
+              err = cu_err;
+            } else {
+              my_bool cu_err;
+              status = mysql_change_user_cont(&cu_err, &mysql, event);
+              err = cu_err;
+            }
+            if (status) {
+              done = true;
+              is_cont = true;
+            } else {
+              is_cont = false;
+              FREE(cu_user);
+              FREE(cu_password);
+              FREE(cu_db);
+              state = STATE_IDLE;
+              if (err) {
+                on_error();
+                if (state == STATE_CLOSED)
+                  return;
+              }
+              on_idle();
+              return;
+            }
+          break;
+          case STATE_SELECTDB:
+            if (!is_cont)
+              status = mysql_select_db_start(&err, &mysql, cu_db);
+            else
+              status = mysql_select_db_cont(&err, &mysql, event);
+            if (status) {
+              done = true;
+              is_cont = true;
+            } else {
+              is_cont = false;
+              FREE(cu_db);
+              state = STATE_IDLE;
+              if (err) {
+                on_error();
+                if (state == STATE_CLOSED)
+                  return;
+              }
+              on_idle();
+              return;
+            }
+          break;
           default:
             done = true;
         }
@@ -928,6 +2415,16 @@ class Client : public Nan::ObjectWrap {
                 threadId, state_strings[state], is_cont, done);
       }
 
+      trace(TRACE_wait, status);
+
+      // the group continues us once the batch has been delivered (later in
+      // this same loop iteration), so stop polling until then instead of
+      // getting woken up for data we are not going to read yet
+      if (batch_full) {
+        uv_poll_stop(poll_handle);
+        return;
+      }
+
       // if we're currently paused due to backpressure, it is important that we
       // do *not* execute `uv_poll_start()` again since doing so *can* lead to
       // the poll handle becoming inactive, causing the db connection to no
@@ -965,6 +2462,54 @@ class Client : public Nan::ObjectWrap {
     static void cb_close_dummy(uv_handle_t* handle) {
     }
 
+    static void cb_free_handle(uv_handle_t* handle) {
+      free(handle);
+    }
+
+    // Rows of a streamed result are only queued while in a group, so neither
+    // pause() nor a stream's highWaterMark can stop the fetch loop until the
+    // batch is delivered. Stop after GROUP_BATCH_ROWS rows per batch instead.
+    bool group_batch_full() {
+      if (!group)
+        return false;
+      if (batch_generation != group->generation) {
+        batch_generation = group->generation;
+        batch_rows = 0;
+      }
+      if (++batch_rows < GROUP_BATCH_ROWS)
+        return false;
+      batch_full = true;
+      group->add_waiter(this);
+      return true;
+    }
+
+    void on_batch_flushed() {
+      batch_full = false;
+      if (state == STATE_ROW && !is_paused)
+        do_work(last_status);
+    }
+
+    void emit(Nan::Callback* cb, int argc, Local<Value> argv[]) {
+      if (group)
+        group->push(cb, Nan::New<Object>(context), argc, argv);
+      else
+        cb->Call(Nan::New<Object>(context), argc, argv);
+    }
+
+#if UV_VERSION_MAJOR == 0
+    static void cb_timeout(uv_timer_t* handle, int status) {
+#else
+    static void cb_timeout(uv_timer_t* handle) {
+#endif
+      Nan::HandleScope scope;
+
+      Client* obj = (Client*)handle->data;
+      DBG_LOG("[%lu] cb_timeout() state=%s\n",
+              obj->threadId, state_strings[obj->state]);
+
+      obj->emit(obj->ontimeout, 0, nullptr);
+    }
+
     static void cb_close(uv_handle_t* handle) {
       Nan::HandleScope scope;
 
@@ -972,7 +2517,7 @@ class Client : public Nan::ObjectWrap {
       DBG_LOG("[%lu] cb_close() state=%s\n",
               obj->threadId, state_strings[obj->state]);
 
-      obj->onclose->Call(Nan::New<Object>(obj->context), 0, nullptr);
+      obj->emit(obj->onclose, 0, nullptr);
     }
 
     static void cb_poll(uv_poll_t* handle, int status, int events) {
@@ -1004,7 +2549,13 @@ class Client : public Nan::ObjectWrap {
     void on_connect() {
       Nan::HandleScope scope;
       DBG_LOG("[%lu] on_connect() state=%s\n", threadId, state_strings[state]);
-      onconnect->Call(Nan::New<Object>(context), 0, nullptr);
+
+      char thread_id[32];
+      snprintf(thread_id, sizeof(thread_id), "%lu", threadId);
+      Local<Value> argv[1] = {
+        Nan::New<String>(thread_id).ToLocalChecked()
+      };
+      emit(onconnect, 1, argv);
     }
 
     void on_error(bool doClose = false,
@@ -1026,18 +2577,22 @@ class Client : public Nan::ObjectWrap {
       if (errNo > 0)
         errCode = errNo;
 
+      trace(TRACE_error, errCode);
+
       if (IS_DEAD_ERRNO(errCode))
         state = STATE_CLOSED;
 
       Local<Object> err =
           Nan::Error(errMsg ? errMsg : mysql_error(&mysql))->ToObject();
-      err->Set(Nan::New<String>(code_symbol), Nan::New<Integer>(errCode));
+      err->Set(Nan::New<String>(addon->code_symbol),
+               Nan::New<Integer>(errCode));
+      err->Set(Nan::New<String>(addon->trace_symbol), trace_to_array());
 
       if (doClose || IS_DEAD_ERRNO(errCode))
         close(IS_DEAD_ERRNO(errCode));
 
       Local<Value> argv[1] = { err };
-      onerror->Call(Nan::New<Object>(context), 1, argv);
+      emit(onerror, 1, argv);
     }
 
     void on_row() {
@@ -1053,38 +2608,17 @@ class Client : public Nan::ObjectWrap {
 
       MYSQL_FIELD* fields = mysql_fetch_fields(cur_result);
       unsigned long* lengths = mysql_fetch_lengths(cur_result);
-      Local<Value> field_value;
       Local<Array> row = Nan::New<Array>(n_fields);
-      // binary field vars
-      unsigned int vlen;
-      unsigned char* buf;
-      uint16_t* new_buf;
 
       on_resultinfo(fields, n_fields);
 
-      for (unsigned int f = 0; f < n_fields; ++f) {
-        if (cur_row[f] == nullptr)
-          field_value = Nan::Null();
-        else if (IS_BINARY(fields[f])) {
-          vlen = lengths[f];
-          buf = (unsigned char*)(cur_row[f]);
-          new_buf = new uint16_t[vlen];
-          for (unsigned long b = 0; b < vlen; ++b)
-            new_buf[b] = buf[b];
-          field_value = Nan::New<String>(new_buf, vlen).ToLocalChecked();
-          delete[] new_buf;
-        } else {
-          field_value =
-            Nan::New<String>(cur_row[f], lengths[f]).ToLocalChecked();
-        }
-
-        row->Set(f, field_value);
-      }
+      for (unsigned int f = 0; f < n_fields; ++f)
+        row->Set(f, make_cell(fields[f], cur_row[f], lengths[f]));
 
       Local<Value> argv[1] = {
         row
       };
-      onrow->Call(Nan::New<Object>(context), 1, argv);
+      emit(onrow, 1, argv);
     }
 
     void on_rows() {
@@ -1102,15 +2636,9 @@ class Client : public Nan::ObjectWrap {
       MYSQL_ROW dbrow;
       uint64_t n_rows = mysql_num_rows(cur_result);
       unsigned long* lengths;
-      Local<Value> field_value;
       Local<Array> row;
       Local<Array> rows;
 
-      // binary field vars
-      unsigned int vlen;
-      unsigned char* buf;
-      uint16_t* new_buf;
-
       if (n_rows <= INT32_MAX)
         rows = Nan::New<Array>(static_cast<int>(n_rows));
       else
@@ -1122,33 +2650,66 @@ class Client : public Nan::ObjectWrap {
         dbrow = mysql_fetch_row(cur_result);
         lengths = mysql_fetch_lengths(cur_result);
         row = Nan::New<Array>(n_fields);
-        for (unsigned int f = 0; f < n_fields; ++f) {
-          if (dbrow[f] == nullptr)
-            field_value = Nan::Null();
-          else if (IS_BINARY(fields[f])) {
-            vlen = lengths[f];
-            buf = (unsigned char*)(dbrow[f]);
-            new_buf = new uint16_t[vlen];
-            for (unsigned long b = 0; b < vlen; ++b)
-              new_buf[b] = buf[b];
-            field_value = Nan::New<String>(new_buf, vlen).ToLocalChecked();
-            delete[] new_buf;
-          } else {
-            field_value =
-              Nan::New<String>(dbrow[f], lengths[f]).ToLocalChecked();
-          }
-          row->Set(f, field_value);
-        }
+        for (unsigned int f = 0; f < n_fields; ++f)
+          row->Set(f, make_cell(fields[f], dbrow[f], lengths[f], true));
         rows->Set(i, row);
       }
 
       Local<Value> argv[1] = {
         rows
       };
-      onrow->Call(Nan::New<Object>(context), 1, argv);
+      emit(onrow, 1, argv);
+    }
+
+    // Passes a LazyResult for the current (buffered) result to JS instead of
+    // converting every column value up front
+    void on_lazy_rows() {
+      DBG_LOG("[%lu] on_lazy_rows() state=%s,need_columns=%d,"
+              "need_metadata=%d\n",
+              threadId, state_strings[state], need_columns, need_metadata);
+
+      unsigned int n_fields = (cur_result ? mysql_num_fields(cur_result) : 0);
+
+      if (n_fields == 0)
+        return;
+
+      Nan::HandleScope scope;
+
+      if (!cur_shared) {
+        cur_shared = new shared_result;
+        cur_shared->res = cur_result;
+        cur_shared->size = result_mem_size(cur_result);
+        cur_shared->refs = 1;
+      }
+
+      Local<Object> lazy_obj =
+        Nan::NewInstance(
+          Nan::New<Function>(addon->lazy_constructor)
+        ).ToLocalChecked();
+      LazyResult* lazy = Nan::ObjectWrap::Unwrap<LazyResult>(lazy_obj);
+      if (!lazy->fill(cur_shared,
+                      one_byte_results,
+                      config.ext_threshold,
+                      req_numbers,
+                      config.tz_offset)) {
+        // Out of memory, fall back to converting everything up front (this
+        // also tells JS to build regular rows)
+        return on_rows();
+      }
+
+      on_resultinfo(mysql_fetch_fields(cur_result), n_fields, true);
+
+      Local<Value> argv[2] = {
+        lazy_obj,
+        Nan::New<Number>(static_cast<double>(lazy->n_rows))
+      };
+      emit(onrow, 2, argv);
     }
 
-    void on_resultinfo(MYSQL_FIELD* fields, unsigned int n_fields) {
+    // `lazy` tells JS whether rows for this result will be LazyResult-backed
+    void on_resultinfo(MYSQL_FIELD* fields,
+                       unsigned int n_fields,
+                       bool lazy = false) {
       if (need_metadata || need_columns) {
         Nan::HandleScope scope;
 
@@ -1160,7 +2721,7 @@ class Client : public Nan::ObjectWrap {
         Local<Value> metadata_v;
 
         if (need_metadata)
-          metadata_v = metadata = Nan::New<Array>(n_fields * 7);
+          metadata_v = metadata = Nan::New<Array>(n_fields * 8);
         else
           metadata_v = Nan::Undefined();
         if (need_columns)
@@ -1176,12 +2737,12 @@ class Client : public Nan::ObjectWrap {
             switch (field.type) {
 #define X(suffix, abbr, literal)                                               \
               case MYSQL_TYPE_##suffix:                                        \
-                ret = Nan::New<String>(col_##abbr##_symbol);                   \
+                ret = Nan::New<String>(addon->col_##abbr##_symbol);            \
               break;
               FIELD_TYPES
 #undef X
               default:
-                ret = Nan::New<String>(col_unsup_symbol);
+                ret = Nan::New<String>(addon->col_unsup_symbol);
             }
             metadata->Set(m++, Nan::New<String>(field.name).ToLocalChecked());
             metadata->Set(m++,
@@ -1193,6 +2754,7 @@ class Client : public Nan::ObjectWrap {
             metadata->Set(m++, Nan::New<String>(field.table).ToLocalChecked());
             metadata->Set(m++,
                           Nan::New<String>(field.org_table).ToLocalChecked());
+            metadata->Set(m++, Nan::New<Integer>(field.decimals));
           }
           if (need_columns) {
             columns->Set(f,
@@ -1203,8 +2765,12 @@ class Client : public Nan::ObjectWrap {
 
         need_columns = need_metadata = false;
 
-        Local<Value> resinfo_argv[2] = { columns_v, metadata_v };
-        onresultinfo->Call(Nan::New<Object>(context), 2, resinfo_argv);
+        Local<Value> resinfo_argv[3] = {
+          columns_v,
+          metadata_v,
+          Nan::New<Boolean>(lazy)
+        };
+        emit(onresultinfo, 3, resinfo_argv);
       }
     }
 
@@ -1234,45 +2800,40 @@ class Client : public Nan::ObjectWrap {
       }
 
       Local<Value> argv[3];
-      int r;
-
-      r = snprintf(u64_buf, sizeof(u64_buf), "%" PRIu64, numRows);
-      if (r <= 0 || r >= sizeof(u64_buf))
-        argv[0] = Nan::EmptyString();
-      else
-        argv[0] = Nan::New<String>(u64_buf, r).ToLocalChecked();
+      uint32_t numbers = (req_numbers
+                          & (NUMBERS_BIGINT_NUMBER | NUMBERS_BIGINT_BIGINT));
 
-      if (affRows == (my_ulonglong)-1)
-        argv[1] = Nan::New<String>(neg_one_symbol);
-      else {
-        r = snprintf(u64_buf, sizeof(u64_buf), "%" PRIu64, affRows);
-        if (r <= 0 || r >= sizeof(u64_buf))
-          argv[1] = Nan::EmptyString();
-        else
-          argv[1] = Nan::New<String>(u64_buf, r).ToLocalChecked();
-      }
+      argv[0] = make_u64(numRows, numbers);
 
-      r = snprintf(u64_buf, sizeof(u64_buf), "%" PRIu64, insertId);
-      if (r <= 0 || r >= sizeof(u64_buf))
-        argv[2] = Nan::EmptyString();
+      if (affRows != (my_ulonglong)-1)
+        argv[1] = make_u64(affRows, numbers);
+#if HAVE_BIGINT
+      else if (numbers & NUMBERS_BIGINT_BIGINT)
+        argv[1] = BigInt::New(v8::Isolate::GetCurrent(), -1);
+#endif
+      else if (numbers & NUMBERS_BIGINT_NUMBER)
+        argv[1] = Nan::New<Integer>(-1);
       else
-        argv[2] = Nan::New<String>(u64_buf, r).ToLocalChecked();
+        argv[1] = Nan::New<String>(addon->neg_one_symbol);
+
+      argv[2] = make_u64(insertId, numbers);
 
-      onresultend->Call(Nan::New<Object>(context), 3, argv);
+      emit(onresultend, 3, argv);
     }
 
     void on_ping() {
       Nan::HandleScope scope;
 
       DBG_LOG("[%lu] on_ping() state=%s\n", threadId, state_strings[state]);
-      onping->Call(Nan::New<Object>(context), 0, nullptr);
+      emit(onping, 0, nullptr);
     }
 
     void on_idle() {
       Nan::HandleScope scope;
 
       DBG_LOG("[%lu] on_idle() state=%s\n", threadId, state_strings[state]);
-      onidle->Call(Nan::New<Object>(context), 0, nullptr);
+      stop_timer();
+      emit(onidle, 0, nullptr);
     }
 
     bool apply_config(Local<Object> cfg) {
@@ -1290,7 +2851,7 @@ class Client : public Nan::ObjectWrap {
 
 #define X(name)                                                                \
       Local<Value> name##_v =                                                  \
-        cfg->Get(Nan::New<String>(cfg_##name##_symbol));
+        cfg->Get(Nan::New<String>(addon->cfg_##name##_symbol));
       CFG_OPTIONS
 #undef X
 
@@ -1384,6 +2945,43 @@ class Client : public Nan::ObjectWrap {
                       *def_grp_s);
       }
 
+      // Sent by libmariadbclient as part of connecting, before the connection
+      // is reported as established
+      if (initCommands_v->IsString()) {
+        Nan::Utf8String cmd_s(initCommands_v);
+        mysql_options(&mysql, MYSQL_INIT_COMMAND, *cmd_s);
+      } else if (initCommands_v->IsArray()) {
+        Local<Array> cmds = Local<Array>::Cast(initCommands_v);
+        for (uint32_t i = 0; i < cmds->Length(); ++i) {
+          Local<Value> cmd_v = cmds->Get(i);
+          if (cmd_v->IsString()) {
+            Nan::Utf8String cmd_s(cmd_v);
+            mysql_options(&mysql, MYSQL_INIT_COMMAND, *cmd_s);
+          }
+        }
+      }
+
+      // Added last so that the session time zone always matches the one used
+      // for decoding temporal values
+      if (timezone_v->IsString()) {
+        Nan::Utf8String timezone_s(timezone_v);
+        config.tz_offset = parse_tz_offset(*timezone_s);
+        if (config.tz_offset != TZ_LOCAL) {
+          long offset = (config.tz_offset < 0
+                         ? -config.tz_offset
+                         : config.tz_offset);
+          char tz_cmd[32];
+          snprintf(tz_cmd, sizeof(tz_cmd), "SET time_zone = '%c%02ld:%02ld'",
+                   (config.tz_offset < 0 ? '-' : '+'),
+                   offset / 3600,
+                   (offset % 3600) / 60);
+          mysql_options(&mysql, MYSQL_INIT_COMMAND, tz_cmd);
+        }
+      }
+
+      if (externalStringThreshold_v->IsUint32())
+        config.ext_threshold = externalStringThreshold_v->Uint32Value();
+
       if (tcpKeepalive_v->IsUint32())
         config.tcpka = tcpKeepalive_v->Uint32Value();
       if (tcpKeepaliveCnt_v->IsUint32())
@@ -1391,6 +2989,36 @@ class Client : public Nan::ObjectWrap {
       if (tcpKeepaliveIntvl_v->IsUint32())
         config.tcpkaIntvl = tcpKeepaliveIntvl_v->Uint32Value();
 
+      if (socket_v->IsObject()) {
+        Local<Object> sock = socket_v->ToObject();
+#define X(name)                                                                \
+        Local<Value> name##_v =                                                \
+            sock->Get(Nan::New<String>(addon->cfg_##name##_symbol));
+        CFG_OPTIONS_SOCKET
+#undef X
+
+        // presets first so that individual options can override them
+        if (profile_v->IsString()) {
+          Nan::Utf8String profile_s(profile_v);
+          if (strcasecmp(*profile_s, "oltp") == 0) {
+            config.sock_quickack = true;
+            config.sock_busy_poll = BUSY_POLL_OLTP;
+          } else if (strcasecmp(*profile_s, "bulk") == 0) {
+            config.sock_sndbuf = SNDBUF_BULK;
+          }
+        }
+        if (noDelay_v->IsBoolean())
+          config.sock_nodelay = noDelay_v->BooleanValue();
+        if (recvBuffer_v->IsInt32() && recvBuffer_v->Int32Value() >= 0)
+          config.sock_rcvbuf = recvBuffer_v->Int32Value();
+        if (sendBuffer_v->IsInt32() && sendBuffer_v->Int32Value() >= 0)
+          config.sock_sndbuf = sendBuffer_v->Int32Value();
+        if (quickAck_v->IsBoolean())
+          config.sock_quickack = quickAck_v->BooleanValue();
+        if (busyPoll_v->IsInt32() && busyPoll_v->Int32Value() >= 0)
+          config.sock_busy_poll = busyPoll_v->Int32Value();
+      }
+
       if (charset_v->IsString() && charset_v->ToString()->Length() > 0) {
         Nan::Utf8String charset_s(charset_v);
         config.charset = strdup(*charset_s);
@@ -1403,7 +3031,7 @@ class Client : public Nan::ObjectWrap {
           Local<Object> ssl = ssl_v->ToObject();
 #define X(name)                                                                \
           Local<Value> name##_v =                                              \
-              ssl->Get(Nan::New<String>(cfg_##name##_symbol));
+              ssl->Get(Nan::New<String>(addon->cfg_##name##_symbol));
           CFG_OPTIONS_SSL
 #undef X
 
@@ -1434,6 +3062,9 @@ class Client : public Nan::ObjectWrap {
                          && rejectUnauthorized_v->BooleanValue()
                          ? &MY_BOOL_TRUE
                          : &MY_BOOL_FALSE));
+
+          if (sessionCache_v->IsBoolean() && !sessionCache_v->BooleanValue())
+            mysql_options(&mysql, MYSQL_OPT_SSL_SESSION_CACHE, &MY_BOOL_FALSE);
         }
 
         mysql_ssl_set(&mysql,
@@ -1462,20 +3093,28 @@ class Client : public Nan::ObjectWrap {
       if (info.Length() == 0 || !info[0]->IsObject())
         return Nan::ThrowTypeError("Missing setup object");
 
+      addon_data* addon =
+        static_cast<addon_data*>(Local<External>::Cast(info.Data())->Value());
       Local<Object> cfg = info[0]->ToObject();
 #define X(name)                                                                \
       Local<Value> v_on##name =                                                \
-        cfg->Get(Nan::New<String>(ev_##name##_symbol));                        \
+        cfg->Get(Nan::New<String>(addon->ev_##name##_symbol));                 \
       if (!v_on##name->IsFunction())                                           \
         return Nan::ThrowTypeError("Missing on" #name " handler");
       EVENT_NAMES
 #undef X
       Local<Value> context_v =
-        cfg->Get(Nan::New<String>(context_symbol));
+        cfg->Get(Nan::New<String>(addon->context_symbol));
       Local<Value> conncfg_v =
-        cfg->Get(Nan::New<String>(conncfg_symbol));
+        cfg->Get(Nan::New<String>(addon->conncfg_symbol));
+      Local<Value> group_v =
+        cfg->Get(Nan::New<String>(addon->group_symbol));
+      if (!group_v->IsUndefined()
+          && !Nan::New(addon->group_constructor)->HasInstance(group_v)) {
+        return Nan::ThrowTypeError("Invalid group");
+      }
 
-      Client* obj = new Client();
+      Client* obj = new Client(addon, Nan::GetCurrentEventLoop());
 
 #define X(name)                                                                \
       obj->on##name = new Nan::Callback(Local<Function>::Cast(v_on##name));
@@ -1485,6 +3124,10 @@ class Client : public Nan::ObjectWrap {
         obj->context.Reset(context_v->ToObject());
       else
         obj->context.Reset(Nan::GetCurrentContext()->Global());
+      if (!group_v->IsUndefined()) {
+        obj->group_ref.Reset(group_v->ToObject());
+        obj->group = Nan::ObjectWrap::Unwrap<ClientGroup>(group_v->ToObject());
+      }
       if (conncfg_v->IsObject())
         obj->apply_config(conncfg_v->ToObject());
       obj->Wrap(info.This());
@@ -1551,12 +3194,42 @@ class Client : public Nan::ObjectWrap {
       obj->ping();
     }
 
+    static NAN_METHOD(ChangeUser) {
+      Client* obj = Nan::ObjectWrap::Unwrap<Client>(info.This());
+      DBG_LOG("[%lu] clientBinding->changeUser()\n", obj->threadId);
+
+      if (obj->state != STATE_IDLE)
+        return Nan::ThrowError("Not ready to change user");
+
+      // Null/undefined arguments keep the current value
+      Nan::Utf8String user(info[0]);
+      Nan::Utf8String password(info[1]);
+      Nan::Utf8String db(info[2]);
+      obj->change_user((info[0]->IsString() ? *user : nullptr),
+                       (info[1]->IsString() ? *password : nullptr),
+                       (info[2]->IsString() ? *db : nullptr));
+    }
+
+    static NAN_METHOD(SelectDb) {
+      Client* obj = Nan::ObjectWrap::Unwrap<Client>(info.This());
+      DBG_LOG("[%lu] clientBinding->selectDb()\n", obj->threadId);
+
+      if (obj->state != STATE_IDLE)
+        return Nan::ThrowError("Not ready to select database");
+      if (info.Length() < 1 || !info[0]->IsString())
+        return Nan::ThrowTypeError("db argument must be a string");
+
+      Nan::Utf8String db(info[0]);
+      obj->select_db(*db);
+    }
+
     static NAN_METHOD(LastInsertId) {
       Client* obj = Nan::ObjectWrap::Unwrap<Client>(info.This());
       DBG_LOG("[%lu] clientBinding->lastInsertId()\n", obj->threadId);
 
       uint64_t insertId = obj->lastInsertId();
 
+      char u64_buf[21];
       int r = snprintf(u64_buf, sizeof(u64_buf), "%" PRIu64, insertId);
       if (r <= 0 || r >= sizeof(u64_buf))
         info.GetReturnValue().Set(Nan::EmptyString());
@@ -1573,10 +3246,10 @@ class Client : public Nan::ObjectWrap {
 
       if (obj->state != STATE_IDLE)
         return Nan::ThrowError("Not ready to query");
-      if (info.Length() < 3)
+      if (info.Length() < 5)
         return Nan::ThrowTypeError("Missing arguments");
-      if (!info[0]->IsString())
-        return Nan::ThrowTypeError("query argument must be a string");
+      if (!info[0]->IsString() && !Buffer::HasInstance(info[0]))
+        return Nan::ThrowTypeError("query argument must be a string or Buffer");
       /*if (!info[0]->IsString() && !stmt_constructor->HasInstance(info[0])) {
         return Nan::ThrowTypeError(
             "query argument must be a string or Statement instance"
@@ -1588,12 +3261,30 @@ class Client : public Nan::ObjectWrap {
         return Nan::ThrowTypeError("metadata argument must be a boolean");
       if (!info[3]->IsBoolean())
         return Nan::ThrowTypeError("buffered argument must be a boolean");
+      if (!info[4]->IsBoolean())
+        return Nan::ThrowTypeError("lazy argument must be a boolean");
+      if (info.Length() > 5 && !info[5]->IsUint32())
+        return Nan::ThrowTypeError("timeout argument must be an integer");
+      if (info.Length() > 6 && !info[6]->IsUint32())
+        return Nan::ThrowTypeError("numbers argument must be an integer");
+#if !HAVE_BIGINT
+      if (info.Length() > 6
+          && (info[6]->Uint32Value()
+              & (NUMBERS_BIGINT_BIGINT
+                 | NUMBERS_DECIMAL_BIGINT
+                 | NUMBERS_DATES_BIGINT))) {
+        return Nan::ThrowError("BigInt is not supported by this node version");
+      }
+#endif
 
       //if (info[0]->IsString()) {
         obj->query(info[0],
                    info[1]->BooleanValue(),
                    info[2]->BooleanValue(),
-                   info[3]->BooleanValue());
+                   info[3]->BooleanValue(),
+                   info[4]->BooleanValue(),
+                   (info.Length() > 5 ? info[5]->Uint32Value() : 0),
+                   (info.Length() > 6 ? info[6]->Uint32Value() : 0));
       /*} else {
         Local<Object> stmt_obj = info[0]->ToObject();
         Statement* stmt = Nan::ObjectWrap::Unwrap<Statement>(stmt_obj);
@@ -1612,14 +3303,50 @@ class Client : public Nan::ObjectWrap {
 
       Nan::Utf8String arg_v(info[0]);
       unsigned long arg_len = arg_v.length();
+      bool fast = obj->can_fast_escape();
+      if (fast && find_escapable(*arg_v, *arg_v + arg_len) == *arg_v + arg_len) {
+        // Nothing to escape, so the original string can be used as-is
+        return info.GetReturnValue().Set(info[0]);
+      }
       char* result = (char*) malloc(arg_len * 2 + 1);
-      unsigned long result_len = obj->escape((char*)*arg_v, arg_len, result);
+      unsigned long result_len;
+      if (fast)
+        result_len = static_cast<unsigned long>(
+          escape_string(result, *arg_v, arg_len)
+        );
+      else
+        result_len = obj->escape((char*)*arg_v, arg_len, result);
       Local<String> escaped_s =
         Nan::New<String>(result, result_len).ToLocalChecked();
       free(result);
       info.GetReturnValue().Set(escaped_s);
     }
 
+    static NAN_METHOD(MemoryUsage) {
+      Client* obj = Nan::ObjectWrap::Unwrap<Client>(info.This());
+      DBG_LOG("[%lu] clientBinding->memoryUsage()\n", obj->threadId);
+
+      Local<Object> usage = Nan::New<Object>();
+      double total = 0;
+#define X(kind)                                                                \
+      usage->Set(Nan::New<String>(obj->addon->mem_##kind##_symbol),            \
+                 Nan::New<Number>(static_cast<double>(obj->mem_##kind)));      \
+      total += obj->mem_##kind;
+      MEM_KINDS
+#undef X
+      usage->Set(Nan::New<String>(obj->addon->mem_total_symbol),
+                 Nan::New<Number>(total));
+
+      info.GetReturnValue().Set(usage);
+    }
+
+    static NAN_METHOD(Trace) {
+      Client* obj = Nan::ObjectWrap::Unwrap<Client>(info.This());
+      DBG_LOG("[%lu] clientBinding->trace()\n", obj->threadId);
+
+      info.GetReturnValue().Set(obj->trace_to_array());
+    }
+
     static NAN_METHOD(IsMariaDB) {
       Client* obj = Nan::ObjectWrap::Unwrap<Client>(info.This());
       DBG_LOG("[%lu] clientBinding->isMariaDB()\n", obj->threadId);
@@ -1644,37 +3371,62 @@ class Client : public Nan::ObjectWrap {
       );
     }
 
-    static void Initialize(Handle<Object> target) {
-      Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+    static void Initialize(Handle<Object> target, addon_data* addon) {
+      Local<FunctionTemplate> tpl =
+        Nan::New<FunctionTemplate>(New, Nan::New<External>(addon));
       Local<String> name = Nan::New<String>("ClientBinding").ToLocalChecked();
 
-      constructor.Reset(tpl);
+      addon->constructor.Reset(tpl);
       tpl->InstanceTemplate()->SetInternalFieldCount(1);
       tpl->SetClassName(name);
 
-      code_symbol.Reset(Nan::New<String>("code").ToLocalChecked());
-      context_symbol.Reset(Nan::New<String>("context").ToLocalChecked());
-      conncfg_symbol.Reset(Nan::New<String>("config").ToLocalChecked());
-      neg_one_symbol.Reset(Nan::New<String>("-1").ToLocalChecked());
+      addon->code_symbol.Reset(Nan::New<String>("code").ToLocalChecked());
+      addon->context_symbol.Reset(Nan::New<String>("context").ToLocalChecked());
+      addon->conncfg_symbol.Reset(Nan::New<String>("config").ToLocalChecked());
+      addon->group_symbol.Reset(Nan::New<String>("group").ToLocalChecked());
+      addon->neg_one_symbol.Reset(Nan::New<String>("-1").ToLocalChecked());
 
 #define X(name)                                                                \
-      ev_##name##_symbol.Reset(Nan::New<String>("on" #name).ToLocalChecked());
+      addon->ev_##name##_symbol.Reset(                                         \
+        Nan::New<String>("on" #name).ToLocalChecked()                          \
+      );
       EVENT_NAMES
 #undef X
 
 #define X(suffix, abbr, literal)                                               \
-      col_##abbr##_symbol.Reset(Nan::New<String>(#literal).ToLocalChecked());
+      addon->col_##abbr##_symbol.Reset(                                        \
+        Nan::New<String>(#literal).ToLocalChecked()                            \
+      );
       FIELD_TYPES
 #undef X
-      col_unsup_symbol.Reset(
+      addon->col_unsup_symbol.Reset(
         Nan::New<String>("[Unknown field type]").ToLocalChecked()
       );
 
 #define X(name)                                                                \
-      cfg_##name##_symbol.Reset(Nan::New<String>(#name).ToLocalChecked());
+      addon->cfg_##name##_symbol.Reset(                                        \
+        Nan::New<String>(#name).ToLocalChecked()                               \
+      );
       CFG_OPTIONS
       CFG_OPTIONS_SSL
+      CFG_OPTIONS_SOCKET
+#undef X
+
+#define X(kind)                                                                \
+      addon->mem_##kind##_symbol.Reset(                                        \
+        Nan::New<String>(#kind).ToLocalChecked()                               \
+      );
+      MEM_KINDS
+#undef X
+      addon->mem_total_symbol.Reset(Nan::New<String>("total").ToLocalChecked());
+
+#define X(field)                                                               \
+      addon->trace_##field##_symbol.Reset(                                     \
+        Nan::New<String>(#field).ToLocalChecked()                              \
+      );
+      TRACE_FIELDS
 #undef X
+      addon->trace_symbol.Reset(Nan::New<String>("trace").ToLocalChecked());
 
       Nan::SetPrototypeMethod(tpl, "connect", Connect);
       Nan::SetPrototypeMethod(tpl, "query", Query);
@@ -1682,11 +3434,15 @@ class Client : public Nan::ObjectWrap {
       Nan::SetPrototypeMethod(tpl, "pause", Pause);
       Nan::SetPrototypeMethod(tpl, "resume", Resume);
       Nan::SetPrototypeMethod(tpl, "ping", Ping);
+      Nan::SetPrototypeMethod(tpl, "changeUser", ChangeUser);
+      Nan::SetPrototypeMethod(tpl, "selectDb", SelectDb);
       Nan::SetPrototypeMethod(tpl, "escape", Escape);
       Nan::SetPrototypeMethod(tpl, "close", Close);
       Nan::SetPrototypeMethod(tpl, "isMariaDB", IsMariaDB);
       Nan::SetPrototypeMethod(tpl, "serverVersion", ServerVersion);
       Nan::SetPrototypeMethod(tpl, "lastInsertId", LastInsertId);
+      Nan::SetPrototypeMethod(tpl, "memoryUsage", MemoryUsage);
+      Nan::SetPrototypeMethod(tpl, "trace", Trace);
 
       target->Set(name, tpl->GetFunction());
     }
@@ -1700,9 +3456,17 @@ static NAN_METHOD(Escape) {
 
   Nan::Utf8String arg_v(info[0]);
   unsigned long arg_len = arg_v.length();
+  const char* first = find_escapable(*arg_v, *arg_v + arg_len);
+  if (first == *arg_v + arg_len) {
+    // Nothing to escape, so the original string can be used as-is
+    return info.GetReturnValue().Set(info[0]);
+  }
   char* result = (char*) malloc(arg_len * 2 + 1);
-  unsigned long result_len =
-      mysql_escape_string_ex(result, (char*)*arg_v, arg_len, "utf8");
+  size_t prefix_len = first - *arg_v;
+  memcpy(result, *arg_v, prefix_len);
+  unsigned long result_len = static_cast<unsigned long>(
+    prefix_len + escape_string(result + prefix_len, first, arg_len - prefix_len)
+  );
   Local<String> escaped_s =
     Nan::New<String>(result, result_len).ToLocalChecked();
   free(result);
@@ -1710,6 +3474,127 @@ static NAN_METHOD(Escape) {
   info.GetReturnValue().Set(escaped_s);
 }
 
+static const char hex_chars[] = "0123456789abcdef";
+
+// Appends the UTF-8 representation of `str` to `out`, escaped and quoted
+static void format_string(std::string& out,
+                          Local<String> str,
+                          std::string& scratch) {
+  size_t len = str->Utf8Length();
+  scratch.resize(len + 1);
+  str->WriteUtf8(&scratch[0],
+                 static_cast<int>(len),
+                 nullptr,
+                 String::NO_NULL_TERMINATION);
+  size_t pos = out.size();
+  out.resize(pos + len * 2 + 2);
+  out[pos++] = '\'';
+  pos += escape_string(&out[pos], &scratch[0], len);
+  out[pos++] = '\'';
+  out.resize(pos);
+}
+
+// Appends the SQL representation of `v` to `out`, matching what
+// `Client.escape(v + '')` (or hex literals for Buffers) would produce
+static void format_value(std::string& out,
+                         Local<Value> v,
+                         std::string& scratch) {
+  if (v->IsNull() || v->IsUndefined()) {
+    out.append("NULL", 4);
+  } else if (v->IsString()) {
+    format_string(out, v.As<String>(), scratch);
+  } else if (v->IsInt32()) {
+    char num_buf[16];
+    int r = snprintf(num_buf, sizeof(num_buf), "'%d'", v->Int32Value());
+    out.append(num_buf, r);
+  } else if (v->IsNumber()) {
+    // Number to string conversions never produce characters that need escaping
+    Nan::Utf8String num_s(v);
+    out += '\'';
+    out.append(*num_s, num_s.length());
+    out += '\'';
+  } else if (v->IsBoolean()) {
+    if (v->BooleanValue())
+      out.append("'true'", 6);
+    else
+      out.append("'false'", 7);
+  } else if (Buffer::HasInstance(v)) {
+    const unsigned char* data = (const unsigned char*)Buffer::Data(v);
+    size_t len = Buffer::Length(v);
+    size_t pos = out.size();
+    out.resize(pos + len * 2 + 3);
+    out[pos++] = 'X';
+    out[pos++] = '\'';
+    for (size_t i = 0; i < len; ++i) {
+      out[pos++] = hex_chars[data[i] >> 4];
+      out[pos++] = hex_chars[data[i] & 0x0F];
+    }
+    out[pos] = '\'';
+  } else if (v->IsArray()) {
+    Local<Array> arr = Local<Array>::Cast(v);
+    uint32_t len = arr->Length();
+    for (uint32_t i = 0; i < len; ++i) {
+      if (i > 0)
+        out += ',';
+      format_value(out, arr->Get(i), scratch);
+    }
+  } else {
+    format_string(out, v->ToString(), scratch);
+  }
+}
+
+static void format_part(std::string& out, Local<Value> part_v) {
+  Local<String> part = part_v->ToString();
+  size_t len = part->Utf8Length();
+  size_t pos = out.size();
+  out.resize(pos + len);
+  part->WriteUtf8(&out[pos],
+                  static_cast<int>(len),
+                  nullptr,
+                  String::NO_NULL_TERMINATION);
+}
+
+// Builds a complete query from the static `parts` of a prepared query and the
+// values referenced by `tokens` (array indexes or object keys) in `values`
+static NAN_METHOD(Format) {
+  DBG_LOG("ClientBinding::format()\n");
+
+  if (info.Length() < 3
+      || !info[0]->IsArray()
+      || !info[1]->IsArray()
+      || !info[2]->IsObject()) {
+    return Nan::ThrowTypeError("Missing parts, tokens, and/or values");
+  }
+
+  Local<Array> parts = Local<Array>::Cast(info[0]);
+  Local<Array> tokens = Local<Array>::Cast(info[1]);
+  Local<Object> values = info[2]->ToObject();
+  uint32_t n_parts = parts->Length();
+  uint32_t n_tokens = tokens->Length();
+  std::string out;
+  std::string scratch;
+
+  // Reserve enough room for the static parts plus a typical quoted value so
+  // that most queries are built without reallocating
+  size_t estimate = 0;
+  for (uint32_t i = 0; i < n_parts; ++i)
+    estimate += parts->Get(i)->ToString()->Utf8Length();
+  out.reserve(estimate + n_tokens * 16);
+
+  uint32_t j = 0;
+  for (; j < n_tokens; ++j) {
+    if (j < n_parts)
+      format_part(out, parts->Get(j));
+    format_value(out, values->Get(tokens->Get(j)), scratch);
+  }
+  for (; j < n_parts; ++j)
+    format_part(out, parts->Get(j));
+
+  info.GetReturnValue().Set(
+    Nan::New<String>(out.data(), static_cast<int>(out.size())).ToLocalChecked()
+  );
+}
+
 static NAN_METHOD(Version) {
   DBG_LOG("ClientBinding::version()\n");
 
@@ -1823,16 +3708,51 @@ static NAN_METHOD(Version) {
 };*/
 // =============================================================================
 
+static uv_once_t library_init_once = UV_ONCE_INIT;
+
+static void init_library() {
+  mysql_library_init(0, nullptr, nullptr);
+}
+
+#if NODE_MAJOR_VERSION >= 11
+static void free_addon_data(void* arg) {
+  delete static_cast<addon_data*>(arg);
+  // frees the client library's per-thread state when a worker exits
+  mysql_thread_end();
+}
+#endif
+
 extern "C" {
-  void init(Handle<Object> target) {
-    Client::Initialize(target);
+  NAN_MODULE_INIT(init) {
+    // The first mysql_init() would otherwise initialize the client library
+    // lazily, which is not safe when multiple worker threads load the addon
+    uv_once(&library_init_once, init_library);
+
+    addon_data* addon = new addon_data();
+#if NODE_MAJOR_VERSION >= 11
+    node::AddEnvironmentCleanupHook(v8::Isolate::GetCurrent(),
+                                    free_addon_data,
+                                    addon);
+#endif
+
+    Client::Initialize(target, addon);
+    ClientGroup::Initialize(target, addon);
+    LazyResult::Initialize(addon);
     //Statement::Initialize(target);
     target->Set(Nan::New<String>("escape").ToLocalChecked(),
                 Nan::New<FunctionTemplate>(Escape)->GetFunction());
+    target->Set(Nan::New<String>("format").ToLocalChecked(),
+                Nan::New<FunctionTemplate>(Format)->GetFunction());
     target->Set(Nan::New<String>("version").ToLocalChecked(),
                 Nan::New<FunctionTemplate>(Version)->GetFunction());
+    target->Set(Nan::New<String>("bigint").ToLocalChecked(),
+                Nan::New<Boolean>(HAVE_BIGINT != 0));
   }
 
+#ifdef NAN_MODULE_WORKER_ENABLED
+  NAN_MODULE_WORKER_ENABLED(sqlclient, init)
+#else
   NODE_MODULE(sqlclient, init);
+#endif
 }
 
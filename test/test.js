@@ -27,6 +27,11 @@ var tests = [
   { what: 'Client::escape()',
     run: function() {
       assert.strictEqual(Client.escape("hello 'world'"), "hello \\'world\\'");
+      assert.strictEqual(Client.escape('hello world'), 'hello world');
+      assert.strictEqual(
+        Client.escape('0123456789abcdef\u00e9\u0000\n\r\u001a"\\'),
+        '0123456789abcdef\u00e9\\0\\n\\r\\Z\\"\\\\'
+      );
       next();
     }
   },
@@ -123,6 +128,21 @@ var tests = [
       next();
     }
   },
+  { what: 'prepare() (value types)',
+    run: function() {
+      var client = new Client();
+      var fn = client.prepare('INSERT INTO foo VALUES (?, ?, ?, ?, ?, ?, ?)');
+      assert.strictEqual(
+        fn([ 123, 1.5, true, null, undefined, "it's", new Buffer([1, 0xAB]) ]),
+        "INSERT INTO foo VALUES ('123', '1.5', 'true', NULL, NULL, 'it\\'s',"
+        + " X'01ab')"
+      );
+      fn = client.prepare('SELECT * FROM foo WHERE id IN (:ids)');
+      assert.strictEqual(fn({ ids: [ 1, 'two', null ] }),
+                         "SELECT * FROM foo WHERE id IN ('1','two',NULL)");
+      next();
+    }
+  },
   { what: 'Non-empty threadId',
     run: function() {
       var finished = false;
@@ -137,6 +157,259 @@ var tests = [
       });
     }
   },
+  { what: 'Connect by host name',
+    run: function() {
+      if (DEFAULT_HOST !== '127.0.0.1' && DEFAULT_HOST !== 'localhost')
+        return next();
+      var finished = false;
+      var client = makeClient({ host: 'localhost', dnsCache: 60000 },
+                              function() {
+        assert.strictEqual(finished, true);
+      });
+      client.query("SELECT 'hello' col1", function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows.slice(), [ { col1: 'hello' } ]);
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'Init commands',
+    run: function() {
+      var finished = false;
+      var client = makeClient({
+        initCommands: [ "SET @foo = 'bar'", "SET time_zone = '+01:00'" ]
+      }, function() {
+        assert.strictEqual(finished, true);
+      });
+      var query = 'SELECT @foo foo, @@session.time_zone tz, CONNECTION_ID() id';
+      client.query(query, function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(
+          rows.slice(),
+          [ { foo: 'bar', tz: '+01:00', id: client.threadId } ]
+        );
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'Socket profile',
+    run: function() {
+      var finished = false;
+      var client = makeClient({
+        socket: { profile: 'bulk', recvBuffer: 1024 * 1024, quickAck: true }
+      }, function() {
+        assert.strictEqual(finished, true);
+      });
+      client.query("SELECT REPEAT('x', 100000) str", function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(rows[0].str.length, 100000);
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'Batched events with Client.Group',
+    run: function() {
+      var group = new Client.Group();
+      var clients = [];
+      var results = [];
+      var pending = 3;
+      for (var i = 0; i < 3; ++i) {
+        var client = makeClient({ group: group, _skipClose: true });
+        clients.push(client);
+        client.query('SELECT ' + i + ' n', function(err, rows) {
+          assert.strictEqual(err, null);
+          results.push(rows[0].n);
+          if (--pending === 0) {
+            assert.deepStrictEqual(results.sort(), [ '0', '1', '2' ]);
+            var open = clients.length;
+            clients.forEach(function(c) {
+              c.on('close', function() {
+                if (--open === 0)
+                  next();
+              });
+              c.end();
+            });
+          }
+        });
+      }
+    }
+  },
+  { what: 'Streamed result with Client.Group',
+    run: function() {
+      var group = new Client.Group();
+      var client = makeClient({ group: group }, function() {
+        assert.strictEqual(count, 2500);
+        assert.strictEqual(paused, true);
+      });
+      var digits = '(SELECT 0 d UNION ALL SELECT 1 UNION ALL SELECT 2'
+                   + ' UNION ALL SELECT 3 UNION ALL SELECT 4 UNION ALL SELECT 5'
+                   + ' UNION ALL SELECT 6 UNION ALL SELECT 7 UNION ALL SELECT 8'
+                   + ' UNION ALL SELECT 9)';
+      var query = 'SELECT a.d + b.d * 10 + c.d * 100 + e.d * 1000 n FROM '
+                  + digits + ' a, ' + digits + ' b, ' + digits + ' c, '
+                  + digits + ' e HAVING n < 2500';
+      var count = 0;
+      var paused = false;
+      client.query(query).on('result', function(res) {
+        res.on('data', function(row) {
+          if (++count === 1200) {
+            paused = true;
+            res.pause();
+            setTimeout(function() {
+              res.resume();
+            }, 10);
+          }
+        }).on('end', function() {
+          client.end();
+        });
+      });
+    }
+  },
+  { what: 'BIGINT and DECIMAL decoding',
+    run: function() {
+      var client = makeClient();
+      var query = "SELECT CAST('9007199254740993' AS SIGNED) big,"
+                  + " CAST(-12 AS SIGNED) small,"
+                  + " CAST('-1234.5' AS DECIMAL(10,2)) price";
+      client.query(query, null, { bigint: 'number' }, function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(rows[0].big, '9007199254740993');
+        assert.strictEqual(rows[0].small, -12);
+        assert.strictEqual(rows[0].price, '-1234.50');
+        assert.strictEqual(rows.info.numRows, 1);
+        if (typeof BigInt !== 'function'
+            || +process.versions.node.split('.')[0] < 11) {
+          return client.end();
+        }
+        var opts = { bigint: 'bigint', decimal: 'bigint', metadata: true };
+        client.query(query, null, opts, function(err, rows) {
+          assert.strictEqual(err, null);
+          assert.strictEqual(rows[0].big, BigInt('9007199254740993'));
+          assert.strictEqual(rows[0].small, BigInt(-12));
+          assert.strictEqual(rows[0].price, BigInt(-123450));
+          assert.strictEqual(rows.info.metadata.price.decimals, 2);
+          assert.strictEqual(rows.info.numRows, BigInt(1));
+          client.end();
+        });
+      });
+    }
+  },
+  { what: 'Date decoding',
+    run: function() {
+      [ '+99:99', '+14:01', '-14:00', '+05:60' ].forEach(function(tz) {
+        assert.throws(function() {
+          new Client({ timezone: tz }).connect();
+        }, /Invalid timezone/);
+      });
+      var client = makeClient({ timezone: 'Z' });
+      var query = "SELECT CAST('2020-01-02 03:04:05.678901' AS DATETIME(6)) dt,"
+                  + " CAST('2020-01-02' AS DATE) d,"
+                  + " CAST('-01:02:03.5' AS TIME(1)) t,"
+                  + ' FROM_UNIXTIME(1600000000) ts';
+      client.query(query, null, { dates: 'number' }, function(err, rows) {
+        assert.strictEqual(err, null);
+        var dt = Date.UTC(2020, 0, 2, 3, 4, 5, 678);
+        assert(Math.abs(rows[0].dt - (dt + 0.901)) < 0.0005,
+               'Wrong DATETIME value: ' + rows[0].dt);
+        assert.strictEqual(rows[0].d, Date.UTC(2020, 0, 2));
+        assert.strictEqual(rows[0].t, -3723500);
+        assert.strictEqual(rows[0].ts, 1600000000000);
+        client.query(query, null, { dates: 'date' }, function(err, rows) {
+          assert.strictEqual(err, null);
+          assert(rows[0].dt instanceof Date);
+          assert.strictEqual(rows[0].dt.getTime(), dt);
+          assert.strictEqual(rows[0].t, -3723500);
+          client.end();
+        });
+      });
+    }
+  },
+  { what: 'Client.fanout()',
+    run: function() {
+      var clients = [];
+      for (var i = 0; i < 3; ++i)
+        clients.push(makeClient({ _skipClose: true }));
+      var query = 'SELECT * FROM (SELECT 10 n UNION ALL SELECT 2 UNION ALL '
+                  + 'SELECT 9) t ORDER BY n';
+      Client.fanout(clients, query, null, { orderBy: 0 }, function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows.map(function(row) { return row.n; }),
+                               [ '2', '2', '2', '9', '9', '9',
+                                 '10', '10', '10' ]);
+        var opts = { orderBy: 'n', limit: 2, useArray: true };
+        Client.fanout(clients, query, null, opts, function(err, rows) {
+          assert.strictEqual(err, null);
+          assert.deepStrictEqual(rows, [ [ '2' ], [ '2' ] ]);
+          var count = 0;
+          // Values are never mistaken for options
+          Client.fanout(clients,
+                        query.replace('ORDER BY', 'WHERE n < :max ORDER BY'),
+                        { max: 10 }).on('data', function(row) {
+            ++count;
+          }).on('end', function() {
+            assert.strictEqual(count, 6);
+            var open = clients.length;
+            clients.forEach(function(c) {
+              c.on('close', function() {
+                if (--open === 0)
+                  next();
+              });
+              c.end();
+            });
+          });
+        });
+      });
+    }
+  },
+  { what: 'Worker threads',
+    run: function() {
+      var Worker;
+      try {
+        Worker = require('worker_threads').Worker;
+      } catch (ex) {
+        return next();
+      }
+      var src = [
+        "var wt = require('worker_threads');",
+        'var Client = require('
+          + JSON.stringify(require.resolve('../lib/Client')) + ');',
+        'var client = new Client(wt.workerData);',
+        "client.query('SELECT CONNECTION_ID() id', function(err, rows) {",
+        '  wt.parentPort.postMessage(err ? err.message : rows[0].id);',
+        '  client.end();',
+        '});'
+      ].join('\n');
+      var config = {
+        host: DEFAULT_HOST,
+        port: DEFAULT_PORT,
+        user: DEFAULT_USER,
+        password: DEFAULT_PASSWORD
+      };
+      var ids = [];
+      var pending = 2;
+      for (var i = 0; i < pending; ++i) {
+        var worker = new Worker(src, { eval: true, workerData: config });
+        worker.on('message', function(id) {
+          ids.push(id);
+        });
+        worker.on('error', function(err) {
+          throw err;
+        });
+        worker.on('exit', function() {
+          if (--pending > 0)
+            return;
+          assert.strictEqual(ids.length, 2);
+          assert(/^\d+$/.test(ids[0]) && /^\d+$/.test(ids[1]),
+                 'Unexpected results: ' + inspect(ids));
+          assert.notStrictEqual(ids[0], ids[1]);
+          next();
+        });
+      }
+    }
+  },
   { what: 'Empty threadId (explicit disable)',
     run: function() {
       var finished = false;
@@ -191,6 +464,53 @@ var tests = [
       });
     }
   },
+  { what: 'memoryUsage()',
+    run: function() {
+      var finished = false;
+      var client = makeClient(function() {
+        assert.strictEqual(finished, true);
+      });
+      var usage = client.memoryUsage();
+      assert.strictEqual(usage.total, 0);
+      client.query("SELECT 'hello' col1", function(err, rows) {
+        assert.strictEqual(err, null);
+        usage = client.memoryUsage();
+        ['result', 'net', 'context', 'query', 'total'].forEach(function(key) {
+          assert.strictEqual(typeof usage[key], 'number');
+        });
+        assert(usage.net > 0);
+        assert(usage.context > 0);
+        assert.strictEqual(usage.total,
+                           usage.result + usage.net + usage.context
+                           + usage.query);
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'trace()',
+    run: function() {
+      var finished = false;
+      var client = makeClient(function() {
+        assert.strictEqual(finished, true);
+      });
+      assert.deepStrictEqual(client.trace(), []);
+      client.query("SELECT 'hello' col1", function(err, rows) {
+        assert.strictEqual(err, null);
+        var trace = client.trace();
+        assert(trace.length > 0);
+        assert(trace.some(function(entry) {
+          return (entry.kind === 'state' && entry.state === 'QUERY');
+        }));
+        trace.forEach(function(entry) {
+          assert.strictEqual(typeof entry.value, 'number');
+          assert.strictEqual(typeof entry.ago, 'number');
+        });
+        finished = true;
+        client.end();
+      });
+    }
+  },
   { what: 'Buffered result (defaults)',
     run: function() {
       var finished = false;
@@ -217,6 +537,40 @@ var tests = [
       });
     }
   },
+  { what: 'Buffered result (Buffer query)',
+    run: function() {
+      var finished = false;
+      var client = makeClient(function() {
+        assert.strictEqual(finished, true);
+      });
+      client.query(new Buffer("SELECT 'h\u00e9llo' col1"),
+                   null,
+                   { useArray: true },
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows[0], ['h\u00e9llo']);
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'Buffered result (externalStringThreshold)',
+    run: function() {
+      var finished = false;
+      var client = makeClient({ externalStringThreshold: 16 }, function() {
+        assert.strictEqual(finished, true);
+      });
+      client.query("SELECT REPEAT('a', 1000) col1, 'short' col2",
+                   null,
+                   { useArray: true },
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows[0], [ new Array(1001).join('a'), 'short' ]);
+        finished = true;
+        client.end();
+      });
+    }
+  },
   { what: 'Buffered result (useArray)',
     run: function() {
       var finished = false;
@@ -645,6 +999,368 @@ var tests = [
       client.end();
     }
   },
+  { what: 'Priority lanes',
+    run: function() {
+      var finished = false;
+      var order = [];
+      var client = makeClient({ priorities: 2 }, function() {
+        assert.strictEqual(finished, true);
+        assert.deepStrictEqual(order, ['first', 'high', 'low']);
+      });
+      client.query("SELECT 'first' col1", function(err) {
+        assert.strictEqual(err, null);
+        order.push('first');
+      });
+      client.query("SELECT 'low' col1", null, { priority: 1 }, function(err) {
+        assert.strictEqual(err, null);
+        order.push('low');
+        finished = true;
+        client.end();
+      });
+      client.query("SELECT 'high' col1", null, { priority: 0 }, function(err) {
+        assert.strictEqual(err, null);
+        order.push('high');
+      });
+    }
+  },
+  { what: 'latin1 results',
+    run: function() {
+      var client = makeClient({ charset: 'latin1' });
+      client.query("SELECT CHAR(0x80, 0x93, 0xE9 USING latin1) c, 'abc' d",
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        // latin1 is cp1252, not ISO-8859-1
+        assert.strictEqual(rows[0].c, '\u20ac\u201c\u00e9');
+        assert.strictEqual(rows[0].d, 'abc');
+        client.end();
+      });
+    }
+  },
+  { what: 'Result cache',
+    run: function() {
+      var finished = false;
+      var client = makeClient({
+        resultCache: { ttl: 60000 },
+        multiStatements: true
+      }, function() {
+        assert.strictEqual(finished, true);
+      });
+      makeFooTable(client, {
+        id: { type: 'INT', options: ['AUTO_INCREMENT', 'PRIMARY KEY'] },
+        name: 'VARCHAR(255)'
+      });
+      client.query("INSERT INTO foo VALUES (NULL, 'hello')", NOOP);
+      client.query('SELECT name FROM foo', null, { cache: true },
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows.slice(), [ { name: 'hello' } ]);
+        assert.strictEqual(rows.info.metadata, undefined);
+        client.query('SELECT name FROM foo', null, { cache: true },
+                     function(err, rows2) {
+          assert.strictEqual(err, null);
+          // Served from the cache
+          assert.strictEqual(rows2, rows);
+          client.query('SELECT name FROM foo',
+                       null,
+                       { cache: true, metadata: true },
+                       function(err, rowsMeta) {
+            assert.strictEqual(err, null);
+            // Served from the same cache entry, but with metadata
+            assert.deepStrictEqual(rowsMeta.slice(), [ { name: 'hello' } ]);
+            assert.strictEqual(rowsMeta.info.metadata.name.org_table, 'foo');
+          });
+          client.query('SELECT name FROM foo',
+                       null,
+                       { cache: true, lazy: true },
+                       function(err, rowsLazy) {
+            assert.strictEqual(err, null);
+            // Caching must not convert the values of lazy rows
+            assert.strictEqual(rowsLazy[0].__values[0], undefined);
+            assert.strictEqual(rowsLazy[0].name, 'hello');
+          });
+          client.query("INSERT INTO foo VALUES (NULL, 'world')", NOOP);
+          client.query('SELECT name FROM foo', null, { cache: true },
+                       function(err, rows3) {
+            assert.strictEqual(err, null);
+            assert.notStrictEqual(rows3, rows);
+            assert.deepStrictEqual(rows3.slice(),
+                                   [ { name: 'hello' }, { name: 'world' } ]);
+            var opts = { cache: true, useArray: true };
+            client.query('SELECT name FROM foo', null, opts,
+                         function(err, rows4) {
+              assert.strictEqual(err, null);
+              // Array rows are cached separately from object rows
+              assert.deepStrictEqual(rows4.slice(),
+                                     [ [ 'hello' ], [ 'world' ] ]);
+              client.query(new Buffer("DELETE FROM foo WHERE name = 'world'"),
+                           NOOP);
+              client.query('SELECT name FROM foo', null, { cache: true },
+                           function(err, rows5) {
+                assert.strictEqual(err, null);
+                assert.deepStrictEqual(rows5.slice(), [ { name: 'hello' } ]);
+                // Writes after a comment or in a later statement invalidate
+                // as well
+                client.query("SELECT 1; /* x */ UPDATE foo SET name = 'hi'",
+                             NOOP);
+                client.query('SELECT name FROM foo', null, { cache: true },
+                             function(err, rows6) {
+                  assert.strictEqual(err, null);
+                  assert.deepStrictEqual(rows6.slice(), [ { name: 'hi' } ]);
+                  // Responses without a result set are not cached
+                  client.query('SET @x = 1', null, { cache: true },
+                               function(err) {
+                    assert.strictEqual(err, null);
+                    finished = true;
+                    client.end();
+                  });
+                });
+              });
+            });
+          });
+        });
+      });
+    }
+  },
+  { what: 'Buffered result with lazy rows',
+    run: function() {
+      var finished = false;
+      var client = makeClient(function() {
+        assert.strictEqual(finished, true);
+      });
+      client.query("SELECT 'hello' col1, NULL col2, 'wörld' col3",
+                   null,
+                   { lazy: true },
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(rows.length, 1);
+        assert.strictEqual(rows.info.numRows, '1');
+        assert.strictEqual(rows[0].col1, 'hello');
+        assert.strictEqual(rows[0].col1, 'hello');
+        assert.strictEqual(rows[0].col2, null);
+        assert.strictEqual(rows[0].col3, 'wörld');
+        assert.deepStrictEqual(JSON.parse(JSON.stringify(rows[0])),
+                               { col1: 'hello', col2: null, col3: 'wörld' });
+        assert.deepStrictEqual(Object.keys(rows[0]),
+                               [ 'col1', 'col2', 'col3' ]);
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'Coalesced queries',
+    run: function() {
+      var finished = false;
+      var client = makeClient(function() {
+        assert.strictEqual(finished, true);
+      });
+      var first;
+      client.query("SELECT 'hello' col1", null, { coalesce: true },
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows.slice(), [ { col1: 'hello' } ]);
+        assert(Object.isFrozen(rows));
+        assert(Object.isFrozen(rows[0]));
+        first = rows;
+      });
+      client.query("SELECT 'hello' col1", null, { coalesce: true },
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(rows, first);
+      });
+      client.query("SELECT 'hello' col1",
+                   null,
+                   { coalesce: true, lazy: true },
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        // Lazy rows are not shared with callers expecting regular rows
+        assert.notStrictEqual(rows, first);
+        assert.strictEqual(rows[0].col1, 'hello');
+      });
+      client.query("SELECT 'hello' col1", NOOP);
+      client.query("SELECT 'hello' col1", null, { coalesce: true },
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        // Not shared across a non-coalesced query
+        assert.notStrictEqual(rows, first);
+        assert(!Object.isFrozen(rows));
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'Idle ping',
+    run: function() {
+      var finished = false;
+      var pings = 0;
+      var client = makeClient({ pingInactive: 100, pingWaitRes: 1000 },
+                              function() {
+        assert.strictEqual(finished, true);
+        assert(pings > 0, 'Expected at least one idle ping');
+      });
+      client.query("SELECT 'hello' col1", function(err) {
+        assert.strictEqual(err, null);
+        var ping = client._handle.ping;
+        client._handle.ping = function() {
+          ++pings;
+          return ping.apply(this, arguments);
+        };
+        setTimeout(function() {
+          client.query("SELECT 'world' col1", function(err, rows) {
+            assert.strictEqual(err, null);
+            assert.deepStrictEqual(rows.slice(), [ { col1: 'world' } ]);
+            finished = true;
+            client.end();
+          });
+        }, 500);
+      });
+    }
+  },
+  { what: 'selectDb() and reset()',
+    run: function() {
+      var finished = false;
+      var client = makeClient(function() {
+        assert.strictEqual(finished, true);
+      });
+      client.query('SET @foo = 1', NOOP);
+      client.selectDb('mysql', function(err) {
+        assert.strictEqual(err, null);
+      });
+      client.query('SELECT DATABASE() db, @foo foo', function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows.slice(), [ { db: 'mysql', foo: '1' } ]);
+      });
+      client.reset(function(err) {
+        assert.strictEqual(err, null);
+      });
+      client.query('SELECT DATABASE() db, @foo foo', function(err, rows) {
+        assert.strictEqual(err, null);
+        // Session variables are gone but the selected database is kept
+        assert.deepStrictEqual(rows.slice(), [ { db: 'mysql', foo: null } ]);
+        client.selectDb('no_such_db_' + Date.now(), function(err) {
+          assert(err instanceof Error);
+          finished = true;
+          client.end();
+        });
+      });
+    }
+  },
+  { what: 'reset() keeps init commands',
+    run: function() {
+      var finished = false;
+      var client = makeClient({
+        initCommands: "SET @foo = 'bar'",
+        timezone: '+01:00'
+      }, function() {
+        assert.strictEqual(finished, true);
+      });
+      client.query("SET @foo = 'baz', time_zone = '+02:00'", NOOP);
+      client.reset(function(err) {
+        assert.strictEqual(err, null);
+      });
+      client.query('SELECT @foo foo, @@session.time_zone tz',
+                   function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows.slice(), [ { foo: 'bar', tz: '+01:00' } ]);
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'Async iterator with batches',
+    run: function() {
+      if (typeof Promise !== 'function')
+        return next();
+      var finished = false;
+      var batches = [];
+      var client = makeClient(function() {
+        assert.strictEqual(finished, true);
+      });
+      var iter = client.iterate(
+        "SELECT 'a' col1 UNION ALL SELECT 'b' UNION ALL SELECT 'c'",
+        null,
+        { useArray: true, batchSize: 2 }
+      );
+      function pull() {
+        iter.next().then(function(r) {
+          if (!r.done) {
+            batches.push(r.value);
+            return pull();
+          }
+          assert.deepStrictEqual(batches, [ [ ['a'], ['b'] ], [ ['c'] ] ]);
+          assert.strictEqual(iter.info.numRows, '3');
+          finished = true;
+          client.end();
+        }, function(err) {
+          assert(false, 'Unexpected error: ' + err);
+        });
+      }
+      pull();
+    }
+  },
+  { what: 'Query timeout',
+    run: function() {
+      var finished = false;
+      var client = makeClient(function() {
+        assert.strictEqual(finished, true);
+      });
+      client.query('SELECT SLEEP(60) ret', null, { timeout: 200 },
+                   function(err) {
+        assert(err instanceof Error);
+        assert.strictEqual(err.code, -2);
+      });
+      client.query("SELECT 'queued' col1", null, { timeout: 100 },
+                   function(err) {
+        // Deadline passed while waiting behind the first query
+        assert(err instanceof Error);
+        assert.strictEqual(err.code, -2);
+      });
+      client.query("SELECT 'after' col1", function(err, rows) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(rows.slice(), [ { col1: 'after' } ]);
+      });
+      // Streamed queries report the timeout as well, even though a killed
+      // SLEEP() does not end in an error
+      var sawError = false;
+      client.query('SELECT SLEEP(60) ret', null, { timeout: 200 })
+            .on('result', function(res) {
+        res.on('error', function(err) {
+          assert.strictEqual(err.code, -2);
+          sawError = true;
+        }).resume();
+      }).on('end', function() {
+        assert.strictEqual(sawError, true);
+        finished = true;
+        client.end();
+      });
+    }
+  },
+  { what: 'Query timeout without KILL QUERY ID',
+    run: function() {
+      var timedOut = false;
+      var client = makeClient({ _skipClose: true });
+      // Pretend the server is too old to kill queries by their id, which
+      // makes the timeout drop the connection instead
+      client._supportsKillQueryId = function() {
+        return false;
+      };
+      client.query('SELECT SLEEP(60) ret', null, { timeout: 200 },
+                   function(err) {
+        assert(err instanceof Error);
+        assert.strictEqual(err.code, -2);
+        timedOut = true;
+      });
+      client.query("SELECT 'after' col1", function(err, rows) {
+        // Queued queries survive and run on a new connection
+        assert.strictEqual(err, null);
+        assert.strictEqual(timedOut, true);
+        assert.deepStrictEqual(rows.slice(), [ { col1: 'after' } ]);
+        client.on('close', function() {
+          next();
+        });
+        client.end();
+      });
+    }
+  },
   { what: 'Abort long running query',
     run: function() {
       var finished = false;